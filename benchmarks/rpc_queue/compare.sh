@@ -0,0 +1,174 @@
+#!/bin/sh
+#
+# Copyright 2024, Technology Innovation Institute
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Build variants of the rpc_queue benchmark and compare them side by side.
+# Run it on the target, the effects compared need several cores:
+#
+#   benchmarks/rpc_queue/compare.sh layout
+#
+#   layout   packed vs. cache line layout (RpcCacheLineLayout), -p 2 -c 2
+#   seq      head commit vs. sequence rings (-S), -p 2/4/16 -c 2
+#   atomics  RpcAtomics llsc vs. outline vs. lse on AArch64, -p 2 -c 2
+#
+# Environment:
+#
+#   RUNS     runs per configuration, the median is printed (3)
+#   MSGS     messages per producer (200000)
+#   CPUS     CPUs the threads are pinned to, as for -a (all)
+#   WORK     build directory (a new temporary directory)
+#   CMAKE_ARGS  extra arguments of every build, e.g. for cross compiling
+#   RUNNER   command the benchmark is run with, e.g. an emulator
+#
+# To compare the atomics on an ARMv8.0 core without LSE and on one with it
+# without AArch64 hardware, cross compile and run under QEMU user mode:
+#
+#   export CC=aarch64-linux-gnu-gcc
+#   export CMAKE_ARGS="-DCMAKE_SYSTEM_NAME=Linux -DCMAKE_SYSTEM_PROCESSOR=aarch64"
+#   RUNNER="qemu-aarch64 -L /usr/aarch64-linux-gnu -cpu cortex-a72" \
+#       benchmarks/rpc_queue/compare.sh atomics
+#   RUNNER="qemu-aarch64 -L /usr/aarch64-linux-gnu -cpu max" \
+#       benchmarks/rpc_queue/compare.sh atomics
+#
+# The lse build faults on the Cortex-A72 and is reported as n/a there.
+#
+
+set -e
+
+src=$(cd "$(dirname "$0")" && pwd)
+work=${WORK:-$(mktemp -d)}
+runs=${RUNS:-3}
+msgs=${MSGS:-200000}
+
+usage() {
+    sed -n 's/^#   //p' "$0" | sed -n '/^\(layout\|seq\|atomics\)/p' >&2
+    exit 1
+}
+
+# build <name> <cmake args...>
+build() {
+    name=$1
+    shift
+    cmake -S "$src" -B "$work/$name" -DCMAKE_BUILD_TYPE=Release $CMAKE_ARGS \
+        "$@" >/dev/null
+    cmake --build "$work/$name" >/dev/null
+}
+
+# First number of "<key>": in the JSON report on stdin
+json() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" | head -n 1
+}
+
+# run <name> <bench args...>
+#
+# Print the throughput and p50 latency of the median run of build <name>,
+# or n/a if the benchmark fails, e.g. on an instruction the CPU lacks.
+run() {
+    name=$1
+    shift
+    set -- -n "$msgs" ${CPUS:+-a "$CPUS"} "$@"
+
+    : > "$work/runs"
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        out=$($RUNNER "$work/$name/rpc_queue_bench" "$@" 2>/dev/null) || {
+            printf '%-22s' "n/a (exit $?)"
+            return 0
+        }
+        if [ "$(echo "$out" | json errors)" != 0 ]; then
+            echo "$name $*: errors reported" >&2
+            exit 1
+        fi
+        echo "$(echo "$out" | json throughput_msgs_per_sec)" \
+             "$(echo "$out" | json p50)" >> "$work/runs"
+        i=$((i + 1))
+    done
+
+    sort -n "$work/runs" | sed -n "$(((runs + 1) / 2))p" |
+        awk '{ printf "%7.2fM/s %7d ns", $1 / 1e6, $2 }'
+}
+
+# row <label> <name> <name> <bench args...>
+row() {
+    label=$1
+    a=$2
+    b=$3
+    shift 3
+    printf '%-12s %s   %s\n' "$label" "$(run "$a" "$@")" "$(run "$b" "$@")"
+}
+
+header() {
+    echo "$(nproc) CPUs, $(uname -m)${RUNNER:+, run with $RUNNER}," \
+         "median of $runs runs, $msgs msgs per producer"
+    if [ "$(nproc)" -lt 2 ]; then
+        echo "warning: a single CPU shows no cache line or contention effects" >&2
+    fi
+    printf '%-12s' ""
+    for column in "$@"; do
+        printf ' %-21s  ' "$column"
+    done
+    echo
+}
+
+compare_layout() {
+    build packed -DRpcCacheLineLayout=OFF
+    build cacheline -DRpcCacheLineLayout=ON
+
+    header "packed msgs/s p50" "cache line msgs/s p50"
+    for mode in queue event rpc; do
+        row "$mode" packed cacheline -m "$mode" -p 2 -c 2
+    done
+}
+
+# The sequence mode is a run time flag, both columns use one build
+compare_seq() {
+    build packed -DRpcCacheLineLayout=OFF
+
+    header "head commit msgs/s p50" "sequence msgs/s p50"
+    for mode in queue event rpc; do
+        for p in 2 4 16; do
+            printf '%-12s %s   %s\n' "$mode -p $p" \
+                "$(run packed -m "$mode" -p "$p" -c 2)" \
+                "$(run packed -m "$mode" -p "$p" -c 2 -S)"
+        done
+    done
+}
+
+compare_atomics() {
+    case "$(uname -m) $CMAKE_ARGS" in
+    *aarch64*)
+        ;;
+    *)
+        echo "warning: RpcAtomics only applies to AArch64 builds" >&2
+        ;;
+    esac
+
+    for atomics in llsc outline lse; do
+        build "$atomics" -DRpcAtomics="$atomics"
+    done
+
+    header "llsc msgs/s p50" "outline msgs/s p50" "lse msgs/s p50"
+    for mode in queue event rpc; do
+        printf '%-12s %s   %s   %s\n' "$mode" \
+            "$(run llsc -m "$mode" -p 2 -c 2)" \
+            "$(run outline -m "$mode" -p 2 -c 2)" \
+            "$(run lse -m "$mode" -p 2 -c 2)"
+    done
+}
+
+case "$1" in
+layout)
+    compare_layout
+    ;;
+seq)
+    compare_seq
+    ;;
+atomics)
+    compare_atomics
+    ;;
+*)
+    usage
+    ;;
+esac
@@ -0,0 +1,1014 @@
+/*
+ * Copyright 2024, Technology Innovation Institute
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Host-native multi-threaded benchmark for the shared memory RPC queues.
+ *
+ * N producer threads and M consumer threads, pinned round-robin to the given
+ * CPUs, drive one of the queue paths over a heap allocated iobuf:
+ *
+ *   queue  raw rpcmsg_enqueue()/rpcmsg_dequeue() with minimal element copy
+ *   event  rpcmsg_event_tx()/rpcmsg_event_rx() through device_event_tx()
+ *   rpc    driver_rpc_request() -> driver_rpc_reply() -> response round-trip
+ *
+ * With a burst size greater than one the bulk variants of the above are used
+ * instead, claiming and committing a burst of ring entries at once.
+ *
+ * Results (throughput, latency percentiles, CAS retries, full/empty events)
+ * are printed as a single JSON object on stdout.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sel4/rpc.h"
+
+/* RpcAtomics of the build, and whether LSE is inlined */
+#ifndef BENCH_ATOMICS
+#define BENCH_ATOMICS ""
+#endif
+#ifdef __ARM_FEATURE_ATOMICS
+#define BENCH_LSE_INLINE	1
+#else
+#define BENCH_LSE_INLINE	0
+#endif
+
+#define BENCH_MAX_THREADS	64
+#define BENCH_MAX_CPUS		256
+
+typedef enum bench_mode {
+	bench_mode_queue = 0,
+	bench_mode_event,
+	bench_mode_rpc,
+	bench_mode_batch,
+	bench_mode_last,
+} bench_mode_t;
+
+static const char *bench_mode_names[bench_mode_last] = {
+	[bench_mode_queue] = "queue",
+	[bench_mode_event] = "event",
+	[bench_mode_rpc] = "rpc",
+	[bench_mode_batch] = "batch",
+};
+
+/* payload slice size for the batch mode */
+#define BENCH_PAYLOAD_SIZE	(RPCMSG_BULK_MAX * sizeof(rpc_irq_update_t))
+
+typedef struct bench_config {
+	bench_mode_t mode;
+	unsigned int producers;
+	unsigned int consumers;
+	unsigned long messages;
+	unsigned int window;
+	unsigned int burst;
+	unsigned int ring_size;
+	unsigned int pool_size;
+	bool spsc;
+	bool seq;
+	bool sleep;
+	bool telemetry;
+	bool flow;
+	bool zero_copy;
+	bool trace;
+	unsigned int ncpus;
+	int cpus[BENCH_MAX_CPUS];
+} bench_config_t;
+
+typedef struct bench_stats {
+	uint64_t msgs;
+	uint64_t cas_retries;
+	uint64_t full;
+	uint64_t empty;
+	uint64_t errors;
+} bench_stats_t;
+
+typedef struct bench_thread {
+	pthread_t thread;
+	unsigned int index;
+	int cpu;
+	bench_stats_t stats;
+} bench_thread_t;
+
+typedef struct bench_item {
+	uint16_t id;
+	uint64_t ts;
+} bench_item_t;
+
+static bench_config_t cfg = {
+	.mode = bench_mode_event,
+	.producers = 1,
+	.consumers = 1,
+	.messages = 1000000,
+	.window = 0,
+	.burst = 1,
+	.ring_size = RPCMSG_RING_SIZE_DEFAULT,
+	.pool_size = RPCMSG_RING_SIZE_DEFAULT,
+};
+
+RPCMSG_WAIT_DEFINE();
+
+static void *iobuf;
+static vso_rpc_t driver_rpc;
+static vso_rpc_t device_rpc;
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t total_msgs;
+static volatile uint64_t consumed;
+static volatile uint64_t doorbells;
+
+/* doorbells of the driver and the device end */
+static sem_t wake[iobuf_end_last];
+
+static uint64_t *latency;
+static volatile uint64_t latency_count;
+
+/* per ring slot timestamps for the raw queue mode */
+static uint64_t slot_ts[RPCMSG_RING_SIZE_MAX];
+
+/* request latency histograms, shared by the rpc clients */
+static vso_trace_t trace;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* requests in flight per rpc client */
+static volatile unsigned int inflight[BENCH_MAX_THREADS];
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void record_latency(uint64_t ts)
+{
+	uint64_t idx = __atomic_fetch_add(&latency_count, 1, __ATOMIC_RELAXED);
+
+	if (idx < total_msgs) {
+		latency[idx] = now_ns() - ts;
+	}
+}
+
+static void bench_doorbell(void *cookie)
+{
+	__atomic_fetch_add(&doorbells, 1, __ATOMIC_RELAXED);
+	sem_post(cookie);
+}
+
+/*
+ * Flow controlled producers (-f) spin for the spin stage of the wait policy,
+ * then park on the doorbell of their end until the consumer signals space.
+ * The timeout covers a wakeup consumed by another stalled producer.
+ */
+static int bench_space_wait(void *cookie, uint32_t iter)
+{
+	struct timespec ts;
+
+	if (iter < rpcmsg_wait_policy.spin) {
+		rpcmsg_cpu_relax();
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100000;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	sem_timedwait(cookie, &ts);
+
+	return 0;
+}
+
+/*
+ * Called by a consumer of @end that found its queues empty. With -d a single
+ * consumer arms the doorbell and sleeps until it rings, like rpc_run() does.
+ */
+static void bench_idle(vso_rpc_t *rpc, rpcmsg_iobuf_end_t end)
+{
+	if (!cfg.sleep || cfg.consumers != 1) {
+		sched_yield();
+		return;
+	}
+
+	if (!vso_rpc_arm(rpc)) {
+		sem_wait(&wake[end]);
+		vso_rpc_disarm(rpc);
+	}
+}
+
+static void bench_enqueue_fn(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			     uint32_t ring_index, void const * const data)
+{
+	const bench_item_t *item = data;
+
+	q->ring[ring_index] = item->id;
+	slot_ts[ring_index] = item->ts;
+}
+
+static void bench_dequeue_fn(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			     uint32_t ring_index, void * const data)
+{
+	bench_item_t *item = data;
+
+	item->id = q->ring[ring_index];
+	item->ts = slot_ts[ring_index];
+}
+
+static bool bench_done(void)
+{
+	return __atomic_load_n(&consumed, __ATOMIC_ACQUIRE) >= total_msgs;
+}
+
+static void bench_consumed(void)
+{
+	if (__atomic_add_fetch(&consumed, 1, __ATOMIC_RELEASE) == total_msgs) {
+		/* let sleeping consumers see that we are done */
+		for (unsigned int i = 0; i < iobuf_end_last; i++) {
+			sem_post(&wake[i]);
+		}
+	}
+}
+
+/******************************** raw queue *********************************/
+
+static void queue_producer(bench_thread_t *t)
+{
+	rpcmsg_rpc_queue_t *rpc = &device_rpc.driver_rpc.request;
+	bench_item_t items[RPCMSG_BULK_MAX];
+	unsigned long i = 0;
+	unsigned int n, j;
+
+	while (i < cfg.messages) {
+		n = min(cfg.burst, cfg.messages - i);
+		for (j = 0; j < n; j++) {
+			items[j].id = t->index;
+			items[j].ts = now_ns();
+		}
+		while (rpcmsg_enqueue_bulk_flags(rpc->queue, rpc->buffer,
+						 rpc->flags, rpc->stats, bench_enqueue_fn,
+						 items, sizeof(items[0]), n)) {
+			t->stats.full++;
+			sched_yield();
+		}
+		t->stats.msgs += n;
+		i += n;
+	}
+}
+
+static void queue_consumer(bench_thread_t *t)
+{
+	rpcmsg_rpc_queue_t *rpc = &driver_rpc.driver_rpc.request;
+	bench_item_t items[RPCMSG_BULK_MAX];
+	unsigned int n, j;
+
+	while (!bench_done()) {
+		n = rpcmsg_dequeue_bulk_flags(rpc->queue, rpc->buffer,
+					      rpc->flags, rpc->stats, bench_dequeue_fn,
+					      items, sizeof(items[0]),
+					      cfg.burst);
+		if (!n) {
+			t->stats.empty++;
+			sched_yield();
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (items[j].id >= cfg.producers) {
+				t->stats.errors++;
+			}
+			record_latency(items[j].ts);
+			bench_consumed();
+		}
+		t->stats.msgs += n;
+	}
+}
+
+/******************************* event queue ********************************/
+
+static void event_producer(bench_thread_t *t)
+{
+	rpcmsg_t msgs[RPCMSG_BULK_MAX];
+	unsigned long i = 0;
+	unsigned int n, j;
+
+	while (i < cfg.messages) {
+		n = min(cfg.burst, cfg.messages - i);
+		for (j = 0; j < n; j++) {
+			msgs[j].mr0 = 0;
+			msgs[j].mr1 = t->index;
+			msgs[j].mr2 = i + j;
+			msgs[j].mr3 = now_ns();
+		}
+		while (device_event_tx_bulk(&device_rpc, QEMU_OP_SET_IRQ, msgs, n)) {
+			t->stats.full++;
+			sched_yield();
+		}
+		t->stats.msgs += n;
+		i += n;
+	}
+}
+
+/* events read in place in their slots, with -z */
+static void event_consumer_zero_copy(bench_thread_t *t)
+{
+	rpcmsg_t *msg;
+
+	while (!bench_done()) {
+		msg = device_event_peek(&driver_rpc);
+		if (!msg) {
+			t->stats.empty++;
+			vso_rpc_space_notify(&driver_rpc);
+			bench_idle(&driver_rpc, iobuf_end_driver);
+			continue;
+		}
+		if (QEMU_OP(msg->mr0) != QEMU_OP_SET_IRQ ||
+		    msg->mr1 >= cfg.producers) {
+			t->stats.errors++;
+		}
+		record_latency(msg->mr3);
+		device_event_release(&driver_rpc, msg);
+		bench_consumed();
+		t->stats.msgs++;
+	}
+}
+
+static void event_consumer(bench_thread_t *t)
+{
+	rpcmsg_t msgs[RPCMSG_BULK_MAX];
+	unsigned int n, j;
+
+	if (cfg.zero_copy) {
+		event_consumer_zero_copy(t);
+		return;
+	}
+
+	while (!bench_done()) {
+		n = rpcmsg_event_rx_bulk(&driver_rpc.device_event, msgs, cfg.burst);
+		if (!n) {
+			t->stats.empty++;
+			vso_rpc_space_notify(&driver_rpc);
+			bench_idle(&driver_rpc, iobuf_end_driver);
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (QEMU_OP(msgs[j].mr0) != QEMU_OP_SET_IRQ ||
+			    msgs[j].mr1 >= cfg.producers) {
+				t->stats.errors++;
+			}
+			record_latency(msgs[j].mr3);
+			bench_consumed();
+		}
+		t->stats.msgs += n;
+	}
+}
+
+/****************************** payload batch *******************************/
+
+/* burst IRQ updates per event, carried in the payload slice */
+static void batch_producer(bench_thread_t *t)
+{
+	rpc_irq_update_t updates[RPCMSG_BULK_MAX];
+	unsigned long i = 0;
+	unsigned int n, j;
+
+	for (j = 0; j < RPCMSG_BULK_MAX; j++) {
+		updates[j].irq = t->index;
+		updates[j].op = RPC_IRQ_SET;
+	}
+
+	while (i < cfg.messages) {
+		n = min(cfg.burst, cfg.messages - i);
+		while (device_event_tx_payload(&device_rpc, QEMU_OP_SET_IRQ_BATCH,
+					       n, now_ns(), updates,
+					       n * sizeof(updates[0]))) {
+			t->stats.full++;
+			sched_yield();
+		}
+		t->stats.msgs += n;
+		i += n;
+	}
+}
+
+static void batch_consumer(bench_thread_t *t)
+{
+	rpc_irq_update_t updates[RPCMSG_BULK_MAX];
+	rpcmsg_t msg;
+	unsigned int n, j;
+	int len;
+
+	while (!bench_done()) {
+		len = device_event_rx_payload(&driver_rpc, &msg, updates,
+					      sizeof(updates));
+		if (len < 0) {
+			t->stats.empty++;
+			vso_rpc_space_notify(&driver_rpc);
+			bench_idle(&driver_rpc, iobuf_end_driver);
+			continue;
+		}
+
+		n = msg.mr1;
+		if (QEMU_OP(msg.mr0) != QEMU_OP_SET_IRQ_BATCH ||
+		    n * sizeof(updates[0]) != (unsigned int) len) {
+			t->stats.errors++;
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (updates[j].irq >= cfg.producers ||
+			    updates[j].op != RPC_IRQ_SET) {
+				t->stats.errors++;
+			}
+			record_latency(msg.mr2);
+			bench_consumed();
+		}
+		t->stats.msgs += n;
+	}
+}
+
+/********************************* request **********************************/
+
+static unsigned int rpc_drain_responses(bench_thread_t *t)
+{
+	unsigned int n = 0;
+	uint16_t id;
+	rpcmsg_t *msg;
+
+	for_each_driver_rpc_resp(msg, id, &driver_rpc) {
+		if (msg->mr1 >= cfg.producers) {
+			t->stats.errors++;
+			continue;
+		}
+		record_latency(msg->mr2);
+		if (cfg.trace) {
+			pthread_mutex_lock(&trace_lock);
+			vso_trace_complete(&driver_rpc, &trace, msg);
+			pthread_mutex_unlock(&trace_lock);
+		}
+		__atomic_fetch_sub(&inflight[msg->mr1], 1, __ATOMIC_RELEASE);
+		bench_consumed();
+		n++;
+	}
+
+	return n;
+}
+
+static void rpc_client(bench_thread_t *t)
+{
+	rpcmsg_t msgs[RPCMSG_BULK_MAX];
+	unsigned long i = 0;
+	unsigned int n, j;
+
+	while (i < cfg.messages) {
+		n = min(cfg.burst, cfg.messages - i);
+		if (__atomic_load_n(&inflight[t->index], __ATOMIC_ACQUIRE) + n > cfg.window) {
+			if (!rpc_drain_responses(t)) {
+				sched_yield();
+			}
+			continue;
+		}
+
+		for (j = 0; j < n; j++) {
+			/* vCPU MMIO, the high priority lane */
+			msgs[j].mr0 = BIT_FIELD_SET(0, RPC_MR0_MMIO_ADDR_SPACE,
+						    AS_GLOBAL);
+			msgs[j].mr1 = t->index;
+			msgs[j].mr2 = now_ns();
+			msgs[j].mr3 = i + j;
+		}
+
+		__atomic_fetch_add(&inflight[t->index], n, __ATOMIC_RELAXED);
+		if (driver_rpc_request_bulk(&driver_rpc, QEMU_OP_MMIO, msgs, n)) {
+			__atomic_fetch_sub(&inflight[t->index], n, __ATOMIC_RELAXED);
+			t->stats.full++;
+			sched_yield();
+			continue;
+		}
+		t->stats.msgs += n;
+		i += n;
+	}
+
+	while (!bench_done()) {
+		if (!rpc_drain_responses(t)) {
+			sched_yield();
+		}
+	}
+}
+
+static void rpc_server(bench_thread_t *t)
+{
+	rpcmsg_t *msgs[RPCMSG_BULK_MAX];
+	unsigned int n, j;
+
+	while (!bench_done()) {
+		n = driver_rpc_receive_bulk(&device_rpc, msgs, cfg.burst);
+		if (!n) {
+			t->stats.empty++;
+			vso_rpc_space_notify(&device_rpc);
+			bench_idle(&device_rpc, iobuf_end_device);
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			while (driver_rpc_reply(&device_rpc, msgs[j])) {
+				t->stats.full++;
+				sched_yield();
+			}
+		}
+		t->stats.msgs += n;
+	}
+}
+
+/****************************************************************************/
+
+typedef void (*bench_fn_t)(bench_thread_t *t);
+
+static const bench_fn_t bench_producers[bench_mode_last] = {
+	[bench_mode_queue] = queue_producer,
+	[bench_mode_event] = event_producer,
+	[bench_mode_rpc] = rpc_client,
+	[bench_mode_batch] = batch_producer,
+};
+
+static const bench_fn_t bench_consumers[bench_mode_last] = {
+	[bench_mode_queue] = queue_consumer,
+	[bench_mode_event] = event_consumer,
+	[bench_mode_rpc] = rpc_server,
+	[bench_mode_batch] = batch_consumer,
+};
+
+static bench_thread_t threads[BENCH_MAX_THREADS];
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *t = arg;
+	bool producer = t < &threads[cfg.producers];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		fprintf(stderr, "cannot pin thread to cpu %d\n", t->cpu);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	if (producer) {
+		bench_producers[cfg.mode](t);
+	} else {
+		bench_consumers[cfg.mode](t);
+	}
+
+	t->stats.cas_retries = rpcmsg_cas_retries;
+
+	return NULL;
+}
+
+static int latency_cmp(const void *l, const void *r)
+{
+	uint64_t a = *(const uint64_t *) l;
+	uint64_t b = *(const uint64_t *) r;
+
+	return (a > b) - (a < b);
+}
+
+static uint64_t percentile(uint64_t n, double p)
+{
+	uint64_t idx;
+
+	if (!n) {
+		return 0;
+	}
+
+	idx = (uint64_t)(p * n);
+	return latency[idx < n ? idx : n - 1];
+}
+
+static const char *queue_names[queue_id_last] = {
+	[queue_id_drvrpc_req] = "drvrpc_req",
+	[queue_id_drvrpc_req_dev] = "drvrpc_req_dev",
+	[queue_id_drvrpc_resp] = "drvrpc_resp",
+	[queue_id_devevt] = "devevt",
+	[queue_id_drvrpc_req_lo] = "drvrpc_req_lo",
+	[queue_id_drvrpc_req_dev_lo] = "drvrpc_req_dev_lo",
+	[queue_id_devevt_lo] = "devevt_lo",
+};
+
+static void bench_report_telemetry(void)
+{
+	rpcmsg_stats_t s;
+
+	printf("  \"telemetry\": {\n");
+	for (unsigned int qid = 0; qid < queue_id_last; qid++) {
+		rpcmsg_queue_stats_read(rpcmsg_iobuf_stats(iobuf, qid), &s);
+		printf("    \"%s\": { \"enqueues\": %" PRIu64
+		       ", \"dequeues\": %" PRIu64 ", \"full\": %" PRIu64
+		       ", \"empty\": %" PRIu64 ", \"cas_retries\": %" PRIu64
+		       ", \"max_occupancy\": %" PRIu64 " }%s\n",
+		       queue_names[qid], s.enqueues, s.dequeues, s.full,
+		       s.empty, s.cas_retries, s.max_occupancy,
+		       qid + 1 < queue_id_last ? "," : "");
+	}
+	printf("  },\n");
+}
+
+static void bench_report_trace(void)
+{
+	static const char *lat_names[vso_lat_last] = {
+		[vso_lat_queue] = "queue",
+		[vso_lat_service] = "service",
+		[vso_lat_return] = "return",
+	};
+	rpcmsg_hist_t *h;
+
+	/* the rpc clients issue a single opcode */
+	for (unsigned int op = 0; op < VSO_TRACE_OPS; op++) {
+		if (!trace.hist[op][vso_lat_queue].count) {
+			continue;
+		}
+		printf("  \"trace\": {\n");
+		printf("    \"op\": %u,\n", op);
+		printf("    \"invalid\": %" PRIu64 ",\n", trace.invalid);
+		for (unsigned int lat = 0; lat < vso_lat_last; lat++) {
+			h = &trace.hist[op][lat];
+			printf("    \"%s_ns\": { \"samples\": %" PRIu64
+			       ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+			       ", \"max\": %" PRIu64 " }%s\n",
+			       lat_names[lat], h->count,
+			       rpcmsg_ticks_to_ns(rpcmsg_hist_quantile(h, 500)),
+			       rpcmsg_ticks_to_ns(rpcmsg_hist_quantile(h, 990)),
+			       rpcmsg_ticks_to_ns(h->max),
+			       lat + 1 < vso_lat_last ? "," : "");
+		}
+		printf("  },\n");
+		break;
+	}
+}
+
+static void bench_report(uint64_t elapsed)
+{
+	bench_stats_t prod = { 0 }, cons = { 0 };
+	uint64_t n = latency_count < total_msgs ? latency_count : total_msgs;
+
+	for (unsigned int i = 0; i < cfg.producers + cfg.consumers; i++) {
+		bench_stats_t *dst = (i < cfg.producers) ? &prod : &cons;
+
+		dst->msgs += threads[i].stats.msgs;
+		dst->cas_retries += threads[i].stats.cas_retries;
+		dst->full += threads[i].stats.full;
+		dst->empty += threads[i].stats.empty;
+		dst->errors += threads[i].stats.errors;
+	}
+
+	qsort(latency, n, sizeof(*latency), latency_cmp);
+
+	printf("{\n");
+	printf("  \"mode\": \"%s\",\n", bench_mode_names[cfg.mode]);
+	printf("  \"ring_size\": %u,\n", cfg.ring_size);
+	printf("  \"pool_size\": %u,\n", cfg.pool_size);
+	printf("  \"cacheline_layout\": %u,\n", RPCMSG_CACHELINE_LAYOUT);
+	printf("  \"atomics\": \"%s\",\n", BENCH_ATOMICS);
+	printf("  \"lse_inline\": %u,\n", BENCH_LSE_INLINE);
+	printf("  \"spsc\": [%u, %u],\n", driver_rpc.device_event.flags,
+	       device_rpc.device_event.flags);
+	printf("  \"seq\": %u,\n", cfg.seq);
+	printf("  \"sleep\": %u,\n", cfg.sleep);
+	printf("  \"zero_copy\": %u,\n", cfg.zero_copy);
+	printf("  \"producers\": %u,\n", cfg.producers);
+	printf("  \"consumers\": %u,\n", cfg.consumers);
+	printf("  \"window\": %u,\n", cfg.window);
+	printf("  \"burst\": %u,\n", cfg.burst);
+	printf("  \"messages\": %" PRIu64 ",\n", total_msgs);
+	printf("  \"elapsed_ns\": %" PRIu64 ",\n", elapsed);
+	printf("  \"throughput_msgs_per_sec\": %.0f,\n",
+	       elapsed ? (double) total_msgs * 1e9 / elapsed : 0.0);
+	printf("  \"latency_ns\": {\n");
+	printf("    \"samples\": %" PRIu64 ",\n", n);
+	printf("    \"min\": %" PRIu64 ",\n", n ? latency[0] : 0);
+	printf("    \"p50\": %" PRIu64 ",\n", percentile(n, 0.50));
+	printf("    \"p99\": %" PRIu64 ",\n", percentile(n, 0.99));
+	printf("    \"p999\": %" PRIu64 ",\n", percentile(n, 0.999));
+	printf("    \"max\": %" PRIu64 "\n", n ? latency[n - 1] : 0);
+	printf("  },\n");
+	printf("  \"cas_retries\": {\n");
+	printf("    \"producer\": %" PRIu64 ",\n", prod.cas_retries);
+	printf("    \"consumer\": %" PRIu64 ",\n", cons.cas_retries);
+	printf("    \"per_msg\": %.4f\n",
+	       total_msgs ? (double)(prod.cas_retries + cons.cas_retries) / total_msgs : 0.0);
+	printf("  },\n");
+	printf("  \"wait\": {\n");
+	printf("    \"waits\": %lu,\n", rpcmsg_wait_stats.waits);
+	printf("    \"spin\": %lu,\n", rpcmsg_wait_stats.stage[rpcmsg_wait_spin]);
+	printf("    \"wfe\": %lu,\n", rpcmsg_wait_stats.stage[rpcmsg_wait_wfe]);
+	printf("    \"backoff\": %lu,\n", rpcmsg_wait_stats.stage[rpcmsg_wait_backoff]);
+	printf("    \"block\": %lu\n", rpcmsg_wait_stats.stage[rpcmsg_wait_block]);
+	printf("  },\n");
+	printf("  \"queue_full\": %" PRIu64 ",\n", prod.full + cons.full);
+	printf("  \"queue_empty\": %" PRIu64 ",\n", prod.empty + cons.empty);
+	printf("  \"doorbells\": %" PRIu64 ",\n", doorbells);
+	printf("  \"flow\": {\n");
+	printf("    \"enabled\": %u,\n", cfg.flow);
+	printf("    \"stalls\": %" PRIu64 ",\n",
+	       driver_rpc.flow_stats.stalls + device_rpc.flow_stats.stalls);
+	printf("    \"stall_ns\": %" PRIu64 ",\n",
+	       rpcmsg_ticks_to_ns(driver_rpc.flow_stats.stall_ticks +
+				  device_rpc.flow_stats.stall_ticks));
+	printf("    \"max_stall_ns\": %" PRIu64 "\n",
+	       rpcmsg_ticks_to_ns(max(driver_rpc.flow_stats.max_stall_ticks,
+				      device_rpc.flow_stats.max_stall_ticks)));
+	printf("  },\n");
+	if (cfg.telemetry) {
+		bench_report_telemetry();
+	}
+	if (cfg.trace) {
+		bench_report_trace();
+	}
+	printf("  \"errors\": %" PRIu64 "\n", prod.errors + cons.errors);
+	printf("}\n");
+}
+
+static int parse_cpus(const char *arg)
+{
+	char *s = strdup(arg);
+	char *tok, *save = NULL;
+
+	if (!s) {
+		return -1;
+	}
+
+	cfg.ncpus = 0;
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (cfg.ncpus >= BENCH_MAX_CPUS) {
+			break;
+		}
+		cfg.cpus[cfg.ncpus++] = atoi(tok);
+	}
+
+	free(s);
+
+	return cfg.ncpus ? 0 : -1;
+}
+
+static void default_cpus(void)
+{
+	cpu_set_t set;
+
+	cfg.ncpus = 0;
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		cfg.cpus[cfg.ncpus++] = 0;
+		return;
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE && cfg.ncpus < BENCH_MAX_CPUS; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cfg.cpus[cfg.ncpus++] = cpu;
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-m queue|event|rpc|batch] [-p producers] [-c consumers]\n"
+		"          [-n messages per producer] [-w rpc window] [-b burst]\n"
+		"          [-r ring size] [-q pool size] [-a cpu,cpu,...]\n"
+		"          [-W spin,wfe,backoff wait policy] [-s] [-S] [-d] [-t] [-f] [-z] [-T]\n"
+		"  -s  use the single producer/consumer path on the ends\n"
+		"      driven by one thread\n"
+		"  -S  use sequence numbered rings, committed per entry\n"
+		"  -d  a single event consumer or rpc server sleeps until the\n"
+		"      doorbell when idle, with doorbell suppression\n"
+		"  -t  enable and report the per queue telemetry of the iobuf\n"
+		"  -f  flow controlled producers stall instead of failing\n"
+		"  -z  event consumers read events in place, one at a time\n"
+		"  -T  trace rpc requests and report their latency breakdown\n",
+		prog);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:p:c:n:w:b:r:q:a:W:sSdtfzTh")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (cfg.mode = 0; cfg.mode < bench_mode_last; cfg.mode++) {
+				if (!strcmp(optarg, bench_mode_names[cfg.mode])) {
+					break;
+				}
+			}
+			if (cfg.mode == bench_mode_last) {
+				return -1;
+			}
+			break;
+		case 'p':
+			cfg.producers = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.consumers = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.messages = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.window = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			cfg.pool_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			if (sscanf(optarg, "%u,%u,%u", &rpcmsg_wait_policy.spin,
+				   &rpcmsg_wait_policy.wfe,
+				   &rpcmsg_wait_policy.backoff) != 3) {
+				return -1;
+			}
+			break;
+		case 's':
+			cfg.spsc = true;
+			break;
+		case 'S':
+			cfg.seq = true;
+			break;
+		case 'd':
+			cfg.sleep = true;
+			break;
+		case 't':
+			cfg.telemetry = true;
+			break;
+		case 'f':
+			cfg.flow = true;
+			break;
+		case 'z':
+			cfg.zero_copy = true;
+			break;
+		case 'T':
+			cfg.trace = true;
+			break;
+		case 'a':
+			if (parse_cpus(optarg)) {
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (!cfg.producers || !cfg.consumers ||
+	    cfg.producers + cfg.consumers > BENCH_MAX_THREADS) {
+		fprintf(stderr, "invalid thread count\n");
+		return -1;
+	}
+
+	if (!rpcmsg_size_valid(cfg.ring_size) || !cfg.pool_size ||
+	    cfg.pool_size > cfg.ring_size) {
+		fprintf(stderr, "invalid ring or pool size\n");
+		return -1;
+	}
+
+	if (!cfg.burst || cfg.burst > RPCMSG_BULK_MAX) {
+		fprintf(stderr, "burst must be between 1 and %u\n",
+			RPCMSG_BULK_MAX);
+		return -1;
+	}
+
+	/* request buffers are lent from the shared message pool, so the total
+	 * number of requests in flight must not exceed the pool size
+	 */
+	if (!cfg.window || cfg.window * cfg.producers > cfg.pool_size) {
+		cfg.window = cfg.pool_size / cfg.producers;
+	}
+	if (cfg.mode == bench_mode_rpc && cfg.window < cfg.burst) {
+		fprintf(stderr, "too many rpc clients for %u buffers\n",
+			cfg.pool_size);
+		return -1;
+	}
+
+	if (!cfg.ncpus) {
+		default_cpus();
+	}
+
+	return 0;
+}
+
+static int bench_setup(void)
+{
+	unsigned int flags = (cfg.telemetry ? RPCMSG_IOBUF_F_STATS : 0) |
+			     (cfg.trace ? RPCMSG_IOBUF_F_TRACE : 0) |
+			     (cfg.seq ? RPCMSG_IOBUF_F_SEQ : 0);
+	size_t size = rpcmsg_iobuf_bytes(cfg.ring_size, cfg.pool_size,
+					 BENCH_PAYLOAD_SIZE) +
+		      rpcmsg_iobuf_seq_bytes(cfg.ring_size) +
+		      rpcmsg_iobuf_stats_bytes() +
+		      rpcmsg_iobuf_trace_bytes(cfg.pool_size);
+
+	size = (size + IOBUF_PAGE_SIZE - 1) & ~(IOBUF_PAGE_SIZE - 1);
+
+	iobuf = aligned_alloc(IOBUF_PAGE_SIZE, size);
+	if (!iobuf) {
+		return -1;
+	}
+	memset(iobuf, 0, size);
+
+	if (rpcmsg_iobuf_layout(iobuf, size, cfg.ring_size, cfg.pool_size,
+				BENCH_PAYLOAD_SIZE, flags)) {
+		return -1;
+	}
+
+	/* the driver end is driven by the rpc clients or the consumers, the
+	 * device end by the rpc servers or the producers
+	 */
+	unsigned int driver_threads = cfg.mode == bench_mode_rpc ? cfg.producers : cfg.consumers;
+	unsigned int device_threads = cfg.mode == bench_mode_rpc ? cfg.consumers : cfg.producers;
+	unsigned int all = 0;
+
+	if (cfg.spsc) {
+		for (unsigned int qid = 0; qid < queue_id_last; qid++) {
+			all |= VSO_QUEUE_SP(qid) | VSO_QUEUE_SC(qid);
+		}
+	}
+
+	/* each end rings the doorbell of its peer */
+	if (sem_init(&wake[iobuf_end_driver], 0, 0) ||
+	    sem_init(&wake[iobuf_end_device], 0, 0)) {
+		return -1;
+	}
+
+	if (vso_rpc_init_spsc(&driver_rpc, vso_rpc_driver, iobuf, bench_doorbell,
+			      &wake[iobuf_end_device],
+			      driver_threads == 1 ? all : 0) ||
+	    vso_rpc_init_spsc(&device_rpc, vso_rpc_device_km, iobuf, bench_doorbell,
+			      &wake[iobuf_end_driver],
+			      device_threads == 1 ? all : 0)) {
+		return -1;
+	}
+
+	if (cfg.flow) {
+		driver_rpc.space_wait = bench_space_wait;
+		driver_rpc.space_wait_cookie = &wake[iobuf_end_driver];
+		device_rpc.space_wait = bench_space_wait;
+		device_rpc.space_wait_cookie = &wake[iobuf_end_device];
+	}
+
+	total_msgs = (uint64_t) cfg.producers * cfg.messages;
+	latency = calloc(total_msgs ? total_msgs : 1, sizeof(*latency));
+	if (!latency) {
+		return -1;
+	}
+
+	return pthread_barrier_init(&start_barrier, NULL,
+				    cfg.producers + cfg.consumers + 1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int nthreads;
+	uint64_t start;
+	int err;
+
+	if (parse_args(argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (bench_setup()) {
+		fprintf(stderr, "setup failed\n");
+		return EXIT_FAILURE;
+	}
+
+	nthreads = cfg.producers + cfg.consumers;
+	for (unsigned int i = 0; i < nthreads; i++) {
+		threads[i].index = (i < cfg.producers) ? i : i - cfg.producers;
+		threads[i].cpu = cfg.cpus[i % cfg.ncpus];
+		err = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create() failed (%s)\n", strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	bench_report(now_ns() - start);
+
+	return EXIT_SUCCESS;
+}
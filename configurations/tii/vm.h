@@ -20,6 +20,10 @@
         string data_size; \
         string ctrl_base; \
         string ctrl_size; \
+        int ring_size; \
+        int pool_size; \
+        int payload_size; \
+        int ioreq_slots; \
     } vm_virtio_devices[] = []; \
     attribute { \
         int id; \
@@ -27,6 +31,9 @@
         string data_size; \
         string ctrl_base; \
         string ctrl_size; \
+        int ring_size; \
+        int pool_size; \
+        int payload_size; \
     } vm_virtio_drivers[] = []; \
 
 #define VM_TII_CONFIGURATION_DEF(num) \
@@ -71,6 +78,10 @@
         "data_size" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_DATA_SIZE), \
         "ctrl_base" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_CTRL_BASE), \
         "ctrl_size" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_CTRL_SIZE), \
+        "ring_size" : VM##_dev##_VM##_drv##_VIRTIO_RING_SIZE, \
+        "pool_size" : VM##_dev##_VM##_drv##_VIRTIO_POOL_SIZE, \
+        "payload_size" : VM##_dev##_VM##_drv##_VIRTIO_PAYLOAD_SIZE, \
+        "ioreq_slots" : VM##_dev##_VM##_drv##_VIRTIO_IOREQ_SLOTS, \
     },
 
 #define VIRTIO_DRIVER_CONFIGURATION_DEF(_dev, _drv) \
@@ -80,6 +91,9 @@
         "data_size" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_DATA_SIZE), \
         "ctrl_base" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_CTRL_BASE), \
         "ctrl_size" : VAR_STRINGIZE(VM##_dev##_VM##_drv##_VIRTIO_CTRL_SIZE), \
+        "ring_size" : VM##_dev##_VM##_drv##_VIRTIO_RING_SIZE, \
+        "pool_size" : VM##_dev##_VM##_drv##_VIRTIO_POOL_SIZE, \
+        "payload_size" : VM##_dev##_VM##_drv##_VIRTIO_PAYLOAD_SIZE, \
     },
 
 #if VMSWIOTLB
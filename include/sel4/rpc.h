@@ -17,6 +17,7 @@
 typedef enum rpcmsg_iobuf_id {
 	iobuf_id_drvrpc = 0,
 	iobuf_id_devevt,
+	iobuf_id_devevt_lo,
 	iobuf_id_last,
 } rpcmsg_iobuf_id_t;
 
@@ -26,24 +27,480 @@ typedef enum rpcmsg_queue_id {
 	queue_id_drvrpc_req_dev,	/* kernel -> user */
 	queue_id_drvrpc_resp,
 	queue_id_devevt,
+	/* low priority lanes, see vso_msg_prio() */
+	queue_id_drvrpc_req_lo,
+	queue_id_drvrpc_req_dev_lo,
+	queue_id_devevt_lo,
 	queue_id_last,
 } rpcmsg_queue_id_t;
 
+#define RPCMSG_IOBUF_MAGIC	0x73346f69	/* "io4s" */
+/* ends of a connection, for the per end state in the iobuf header */
+typedef enum rpcmsg_iobuf_end {
+	iobuf_end_driver = 0,
+	iobuf_end_device,
+	iobuf_end_last,
+} rpcmsg_iobuf_end_t;
+
+#define RPCMSG_IOBUF_VERSION	14
+
+/* doorbell kicks of the device, see vso_rpc_kick() */
+#define RPCMSG_KICK_MAX		64
+#define RPCMSG_KICK_WORDS	(RPCMSG_KICK_MAX / 32)
+
+/* interrupt lines raised without messages, see vso_rpc_irq() */
+#define RPCMSG_IRQ_MAX		256
+#define RPCMSG_IRQ_WORDS	(RPCMSG_IRQ_MAX / 32)
+
+/* Doorbell state of an end, see vso_rpc_arm() */
+#define VSO_ARMED_POLLING	0	/* no doorbell needed */
+#define VSO_ARMED_SLEEPING	1	/* ring once, then polling */
+#define VSO_ARMED_ALWAYS	2	/* no suppression, ring every time */
+
+/*
+ * Shared I/O buffer header. The driver side lays out the buffers and queues
+ * after the header according to its configuration and publishes the layout
+ * by writing the magic last. The device side checks the magic, version and
+ * sizes before using the queues.
+ */
 typedef struct rpcmsg_iobuf {
-	rpcmsg_buffer_t buffers[iobuf_id_last];
-	rpcmsg_queue_t queues[queue_id_last];
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint32_t pool_size;
+	/* payload slice size per message */
+	uint32_t payload_size;
+	uint32_t size;
+	/* RPCMSG_CACHELINE_LAYOUT of the driver side */
+	uint32_t layout;
+	/* offsets from the beginning of the iobuf */
+	uint32_t buffers[iobuf_id_last];
+	uint32_t queues[queue_id_last];
+	/* queue telemetry, rpcmsg_queue_stats_t[queue_id_last], 0 if off */
+	uint32_t stats;
+	/* request tracing, rpcmsg_trace_t[pool_size], 0 if off */
+	uint32_t trace;
+	/* coalesced MMIO writes, rpcmsg_coalesced_t, 0 if off */
+	uint32_t coalesced;
+	/* register shadow, rpcmsg_shadow_t, 0 if off */
+	uint32_t shadow;
+	/* VSO_ARMED_* state of each end, see vso_rpc_arm() */
+	volatile uint32_t armed[iobuf_end_last];
+	/* producers of each end waiting for space, see vso_rpc_stall() */
+	volatile uint32_t space_waiters[iobuf_end_last];
+	/* pending doorbell kicks of the device, see vso_rpc_kick() */
+	volatile uint32_t kicks[RPCMSG_KICK_WORDS];
+	/* interrupt line state of the device, see vso_rpc_irq() */
+	volatile uint32_t irq_level[RPCMSG_IRQ_WORDS];
+	volatile uint32_t irq_pulse[RPCMSG_IRQ_WORDS];
+	volatile uint32_t irq_pending[RPCMSG_IRQ_WORDS];
 } rpcmsg_iobuf_t;
 
+/* Bytes of shared memory needed by the iobuf */
+#define rpcmsg_iobuf_bytes(_ring_size, _pool_size, _payload_size)	\
+	(RPCMSG_ALIGN(sizeof(rpcmsg_iobuf_t)) +				\
+	 rpcmsg_buffer_bytes(_pool_size, _payload_size) +		\
+	 2 * rpcmsg_buffer_bytes(_ring_size, _payload_size) +		\
+	 (queue_id_last - 2) * rpcmsg_queue_bytes(_ring_size) +		\
+	 2 * rpcmsg_queue_bytes(0))
+
+/* Bytes of the optional queue telemetry, RPCMSG_IOBUF_F_STATS. The shards
+ * are cache line aligned regardless of RPCMSG_CACHELINE_LAYOUT.
+ */
+#define rpcmsg_iobuf_stats_bytes()					\
+	(queue_id_last * sizeof(rpcmsg_queue_stats_t) +		\
+	 RPCMSG_CACHELINE_SIZE - RPCMSG_LAYOUT_ALIGN)
+
+/* Bytes of the optional request tracing, RPCMSG_IOBUF_F_TRACE */
+#define rpcmsg_iobuf_trace_bytes(_pool_size)				\
+	RPCMSG_ALIGN((_pool_size) * sizeof(rpcmsg_trace_t))
+
+/*
+ * Coalesced MMIO
+ *
+ * Writes to regions configured with SEL4_MMIO_REGION_COALESCED are appended
+ * by the driver's vCPUs to this ring instead of being sent as requests. The
+ * single consumer, the device, must drain the ring before it processes any
+ * request, which keeps the writes ordered before later accesses. Each entry
+ * carries a sequence: pos + 1 once written at pos, pos + size once consumed.
+ */
+#define RPCMSG_COALESCED_SIZE	64
+
+typedef struct rpcmsg_coalesced_entry {
+	volatile uint32_t seq;
+	uint32_t len;
+	uint64_t addr;
+	uint64_t data;
+} rpcmsg_coalesced_entry_t;
+
+typedef struct rpcmsg_coalesced {
+	volatile uint32_t tail;
+	volatile uint32_t head;
+	rpcmsg_coalesced_entry_t entries[RPCMSG_COALESCED_SIZE];
+} rpcmsg_coalesced_t;
+
+static inline void rpcmsg_coalesced_init(rpcmsg_coalesced_t *ring)
+{
+	uint32_t i;
+
+	for (i = 0; i < RPCMSG_COALESCED_SIZE; i++) {
+		ring->entries[i].seq = i;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/*
+ * Append a write of @len bytes of @data at @addr. Returns the position of
+ * the entry, or -1 if the ring is full.
+ */
+static inline int64_t rpcmsg_coalesced_push(rpcmsg_coalesced_t *ring,
+					    uint64_t addr, uint32_t len,
+					    uint64_t data)
+{
+	rpcmsg_coalesced_entry_t *e;
+	uint32_t pos = atomic_load_relaxed(&ring->tail);
+	int32_t diff;
+
+	for (;;) {
+		e = &ring->entries[pos % RPCMSG_COALESCED_SIZE];
+		diff = (int32_t)(atomic_load_acquire(&e->seq) - pos);
+		if (diff < 0) {
+			return -1;
+		}
+		if (!diff &&
+		    atomic_compare_and_swap_relaxed(&ring->tail, &pos, pos + 1)) {
+			break;
+		}
+		if (diff) {
+			pos = atomic_load_relaxed(&ring->tail);
+		}
+	}
+
+	e->addr = addr;
+	e->len = len;
+	e->data = data;
+	atomic_store_release(&e->seq, pos + 1);
+
+	return pos;
+}
+
+/* Is there a write for the consumer? */
+static inline bool rpcmsg_coalesced_ready(rpcmsg_coalesced_t *ring)
+{
+	uint32_t pos = atomic_load_relaxed(&ring->head);
+	rpcmsg_coalesced_entry_t *e = &ring->entries[pos % RPCMSG_COALESCED_SIZE];
+
+	return atomic_load_acquire(&e->seq) == pos + 1;
+}
+
+/* Take the oldest write, returns false if there is none */
+static inline bool rpcmsg_coalesced_pop(rpcmsg_coalesced_t *ring,
+					rpcmsg_coalesced_entry_t *entry)
+{
+	uint32_t pos = atomic_load_relaxed(&ring->head);
+	rpcmsg_coalesced_entry_t *e = &ring->entries[pos % RPCMSG_COALESCED_SIZE];
+
+	if (atomic_load_acquire(&e->seq) != pos + 1) {
+		return false;
+	}
+
+	entry->addr = e->addr;
+	entry->len = e->len;
+	entry->data = e->data;
+
+	atomic_store_release(&e->seq, pos + RPCMSG_COALESCED_SIZE);
+	atomic_store_release(&ring->head, pos + 1);
+
+	return true;
+}
+
+/*
+ * Register shadow
+ *
+ * The device keeps the values of read-mostly registers, such as the virtio
+ * ISR and device status, in the shadow and configures their MMIO regions
+ * with SEL4_MMIO_REGION_SHADOW. The driver then serves guest reads of them
+ * from the shadow without a request. Registers are naturally aligned and
+ * little endian. Reads of SEL4_MMIO_REGION_READ_CLEAR regions exchange the
+ * register with zero and set the bit of its 8-byte word in @cleared, which
+ * the device takes with vso_rpc_shadow_cleared_take(). Writes still go to
+ * the device, which updates the shadow itself; registers depending on posted
+ * or coalesced writes must not be shadowed, a read could overtake them.
+ */
+#define RPCMSG_SHADOW_SIZE	256
+
+typedef struct rpcmsg_shadow {
+	/* bit n: a register in regs[8n..8n+7] was read and cleared */
+	volatile uint32_t cleared;
+	uint32_t reserved;
+	volatile uint64_t regs[RPCMSG_SHADOW_SIZE / 8];
+} rpcmsg_shadow_t;
+
+/* Bytes of the optional register shadow, RPCMSG_IOBUF_F_SHADOW */
+#define rpcmsg_iobuf_shadow_bytes()					\
+	RPCMSG_ALIGN(sizeof(rpcmsg_shadow_t))
+
+/* Bytes of the optional coalesced MMIO ring, RPCMSG_IOBUF_F_COALESCED */
+#define rpcmsg_iobuf_coalesced_bytes()					\
+	RPCMSG_ALIGN(sizeof(rpcmsg_coalesced_t))
+
+/* Bytes of the entry sequence arrays of sequence queues, RPCMSG_IOBUF_F_SEQ */
+#define rpcmsg_iobuf_seq_bytes(_ring_size)				\
+	(queue_id_last * rpcmsg_queue_seq_bytes(_ring_size))
+
+#define IOBUF_PAGE_SIZE 4096
+
+#define iobuf_num_pages(_ring_size, _pool_size, _payload_size)		\
+	((rpcmsg_iobuf_bytes((_ring_size), (_pool_size), (_payload_size)) + \
+	  IOBUF_PAGE_SIZE - 1) / IOBUF_PAGE_SIZE)
+
+/* Pages mapped for the iobuf with the default configuration, the cache line
+ * layout pads every buffer and queue
+ */
+#if RPCMSG_CACHELINE_LAYOUT
+#define IOBUF_NUM_PAGES 3
+#else
 #define IOBUF_NUM_PAGES 2
+#endif
+
+static inline rpcmsg_buffer_t *rpcmsg_iobuf_buffer(void *iobuf,
+						   rpcmsg_iobuf_id_t bid)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	return (rpcmsg_buffer_t *)((char *)iobuf + hdr->buffers[bid]);
+}
+
+static inline rpcmsg_queue_t *rpcmsg_iobuf_queue(void *iobuf,
+						 rpcmsg_queue_id_t qid)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	return (rpcmsg_queue_t *)((char *)iobuf + hdr->queues[qid]);
+}
+
+/* Telemetry of queue @qid, NULL if the iobuf has been laid out without */
+static inline rpcmsg_queue_stats_t *rpcmsg_iobuf_stats(void *iobuf,
+						       rpcmsg_queue_id_t qid)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	if (!hdr->stats) {
+		return NULL;
+	}
+
+	return (rpcmsg_queue_stats_t *)((char *)iobuf + hdr->stats) + qid;
+}
+
+/* Trace stamps of the messages of buffer @bid, NULL if not traced */
+static inline rpcmsg_trace_t *rpcmsg_iobuf_trace(void *iobuf,
+						 rpcmsg_iobuf_id_t bid)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	if (!hdr->trace || bid != iobuf_id_drvrpc) {
+		return NULL;
+	}
+
+	return (rpcmsg_trace_t *)((char *)iobuf + hdr->trace);
+}
+
+/* rpcmsg_iobuf_layout() flags */
+#define RPCMSG_IOBUF_F_STATS	1	/* per queue telemetry */
+#define RPCMSG_IOBUF_F_TRACE	2	/* request tracing */
+#define RPCMSG_IOBUF_F_SEQ	4	/* sequence queues, RPCMSG_QUEUE_F_SEQ */
+#define RPCMSG_IOBUF_F_COALESCED 8	/* coalesced MMIO ring */
+#define RPCMSG_IOBUF_F_SHADOW	16	/* register shadow */
+
+/*
+ * Lay out and initialize the buffers and queues in @iobuf of @iobuf_size
+ * bytes. Every queue gets @ring_size entries, the request-reply message pool
+ * @pool_size messages, and every message a payload slice of @payload_size
+ * bytes. With RPCMSG_IOBUF_F_TRACE in @flags the request trace stamps, and
+ * with RPCMSG_IOBUF_F_STATS the queue telemetry, are placed after the
+ * queues. RPCMSG_IOBUF_F_SEQ makes every queue a sequence queue, and
+ * RPCMSG_IOBUF_F_COALESCED and RPCMSG_IOBUF_F_SHADOW add the coalesced MMIO
+ * ring and the register shadow. Called by the driver side only.
+ */
+static inline int rpcmsg_iobuf_layout(void *iobuf, size_t iobuf_size,
+				      uint32_t ring_size, uint32_t pool_size,
+				      uint32_t payload_size, unsigned int flags)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+	rpcmsg_buffer_t *b;
+	rpcmsg_queue_t *q;
+	uint32_t offset;
+	size_t size;
+	unsigned int i;
+
+	if (!iobuf || !rpcmsg_size_valid(ring_size) ||
+	    !pool_size || pool_size > ring_size ||
+	    !rpcmsg_payload_size_valid(payload_size)) {
+		return -1;
+	}
+
+	size = rpcmsg_iobuf_bytes(ring_size, pool_size, payload_size);
+	if (flags & RPCMSG_IOBUF_F_SEQ) {
+		size += rpcmsg_iobuf_seq_bytes(ring_size);
+	}
+	if (flags & RPCMSG_IOBUF_F_TRACE) {
+		size += rpcmsg_iobuf_trace_bytes(pool_size);
+	}
+	if (flags & RPCMSG_IOBUF_F_COALESCED) {
+		size += rpcmsg_iobuf_coalesced_bytes();
+	}
+	if (flags & RPCMSG_IOBUF_F_SHADOW) {
+		size += rpcmsg_iobuf_shadow_bytes();
+	}
+	if (flags & RPCMSG_IOBUF_F_STATS) {
+		size += rpcmsg_iobuf_stats_bytes();
+	}
+
+	if (size > iobuf_size) {
+		return -1;
+	}
+
+	/* invalidate the old layout first */
+	atomic_store_release(&hdr->magic, 0);
+
+	hdr->version = RPCMSG_IOBUF_VERSION;
+	hdr->ring_size = ring_size;
+	hdr->pool_size = pool_size;
+	hdr->payload_size = payload_size;
+	hdr->size = size;
+	hdr->layout = RPCMSG_CACHELINE_LAYOUT;
+
+	offset = RPCMSG_ALIGN(sizeof(*hdr));
+
+	/* request-reply messages are lent from the pool */
+	hdr->buffers[iobuf_id_drvrpc] = offset;
+	b = rpcmsg_iobuf_buffer(iobuf, iobuf_id_drvrpc);
+	rpcmsg_buffer_setup(b, pool_size, payload_size);
+	rpcmsg_buffer_init(b);
+	offset += rpcmsg_buffer_bytes(pool_size, payload_size);
+
+	/* events are stored in the slot matching the ring entry, so each
+	 * event lane has a buffer of its own
+	 */
+	for (i = iobuf_id_devevt; i <= iobuf_id_devevt_lo; i++) {
+		hdr->buffers[i] = offset;
+		b = rpcmsg_iobuf_buffer(iobuf, i);
+		rpcmsg_buffer_setup(b, ring_size, payload_size);
+		rpcmsg_buffer_init(b);
+		offset += rpcmsg_buffer_bytes(ring_size, payload_size);
+	}
+
+	for (i = 0; i < queue_id_last; i++) {
+		uint32_t qflags = (flags & RPCMSG_IOBUF_F_SEQ) ?
+				  RPCMSG_QUEUE_F_SEQ : 0;
+
+		/* events sit in their slots, the event queues have no ring */
+		if (i == queue_id_devevt || i == queue_id_devevt_lo) {
+			qflags |= RPCMSG_QUEUE_F_INLINE;
+		}
+
+		hdr->queues[i] = offset;
+		q = rpcmsg_iobuf_queue(iobuf, i);
+		rpcmsg_queue_setup(q, ring_size, qflags);
+		rpcmsg_queue_init(q);
+		offset += rpcmsg_queue_bytes(rpcmsg_queue_ring_entries(q));
+		if (flags & RPCMSG_IOBUF_F_SEQ) {
+			offset += rpcmsg_queue_seq_bytes(ring_size);
+		}
+	}
+
+	hdr->trace = 0;
+	if (flags & RPCMSG_IOBUF_F_TRACE) {
+		hdr->trace = offset;
+		memset((char *)iobuf + offset, 0,
+		       rpcmsg_iobuf_trace_bytes(pool_size));
+		offset += rpcmsg_iobuf_trace_bytes(pool_size);
+	}
+
+	hdr->coalesced = 0;
+	if (flags & RPCMSG_IOBUF_F_COALESCED) {
+		hdr->coalesced = offset;
+		rpcmsg_coalesced_init((rpcmsg_coalesced_t *)((char *)iobuf + offset));
+		offset += rpcmsg_iobuf_coalesced_bytes();
+	}
+
+	hdr->shadow = 0;
+	if (flags & RPCMSG_IOBUF_F_SHADOW) {
+		hdr->shadow = offset;
+		memset((char *)iobuf + offset, 0, rpcmsg_iobuf_shadow_bytes());
+		offset += rpcmsg_iobuf_shadow_bytes();
+	}
+
+	hdr->stats = 0;
+	if (flags & RPCMSG_IOBUF_F_STATS) {
+		hdr->stats = (offset + RPCMSG_CACHELINE_SIZE - 1) &
+			     ~(RPCMSG_CACHELINE_SIZE - 1);
+		memset((char *)iobuf + hdr->stats, 0,
+		       queue_id_last * sizeof(rpcmsg_queue_stats_t));
+	}
+
+	for (i = 0; i < iobuf_end_last; i++) {
+		hdr->armed[i] = VSO_ARMED_ALWAYS;
+		hdr->space_waiters[i] = 0;
+	}
+
+	for (i = 0; i < RPCMSG_KICK_WORDS; i++) {
+		hdr->kicks[i] = 0;
+	}
+
+	for (i = 0; i < RPCMSG_IRQ_WORDS; i++) {
+		hdr->irq_level[i] = 0;
+		hdr->irq_pulse[i] = 0;
+		hdr->irq_pending[i] = 0;
+	}
 
-#define iobuf_queue(_addr, _bid, _qid, _type)		\
-	({						\
-	 rpcmsg_iobuf_t *_iobuf = (void *)(_addr);	\
-	 _type _q = {					\
-		.buffer = &_iobuf->buffers[(_bid)],	\
-		.queue = &_iobuf->queues[(_qid)],	\
-	 };						\
-	 _q;						\
+	atomic_store_release(&hdr->magic, RPCMSG_IOBUF_MAGIC);
+
+	return 0;
+}
+
+/*
+ * Check that @iobuf has been laid out by the driver side with a compatible
+ * version and memory layout, and that it fits to @iobuf_size bytes and
+ * matches given ring, pool and payload sizes. Zero @iobuf_size, @ring_size,
+ * @pool_size or @payload_size skips the check in question.
+ */
+static inline int rpcmsg_iobuf_check(void *iobuf, size_t iobuf_size,
+				     uint32_t ring_size, uint32_t pool_size,
+				     uint32_t payload_size)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	if (!iobuf || atomic_load_acquire(&hdr->magic) != RPCMSG_IOBUF_MAGIC) {
+		return -1;
+	}
+
+	if (hdr->version != RPCMSG_IOBUF_VERSION ||
+	    hdr->layout != RPCMSG_CACHELINE_LAYOUT) {
+		return -1;
+	}
+
+	if ((iobuf_size && hdr->size > iobuf_size) ||
+	    (ring_size && hdr->ring_size != ring_size) ||
+	    (pool_size && hdr->pool_size != pool_size) ||
+	    (payload_size && hdr->payload_size != payload_size)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+#define iobuf_queue(_addr, _bid, _qid, _type)			\
+	({							\
+	 void *_iobuf = (void *)(_addr);			\
+	 _type _q = {						\
+		.buffer = rpcmsg_iobuf_buffer(_iobuf, (_bid)),	\
+		.queue = rpcmsg_iobuf_queue(_iobuf, (_qid)),	\
+		.stats = rpcmsg_iobuf_stats(_iobuf, (_qid)),	\
+		.trace = rpcmsg_iobuf_trace(_iobuf, (_bid)),	\
+	 };							\
+	 _q;							\
 	 })
 
 #define driver_drvrpc_req(_addr) iobuf_queue((_addr), iobuf_id_drvrpc, queue_id_drvrpc_req, rpcmsg_rpc_queue_t)
@@ -57,7 +514,14 @@ typedef struct rpcmsg_iobuf {
 
 #define devevt_queue(_addr) iobuf_queue((_addr), iobuf_id_devevt, queue_id_devevt, rpcmsg_event_queue_t)
 
-static_assert(sizeof(rpcmsg_iobuf_t) < 4096 * IOBUF_NUM_PAGES,
+#define driver_drvrpc_req_lo(_addr) iobuf_queue((_addr), iobuf_id_drvrpc, queue_id_drvrpc_req_lo, rpcmsg_rpc_queue_t)
+#define device_km_drvrpc_req_lo(_addr) iobuf_queue((_addr), iobuf_id_drvrpc, queue_id_drvrpc_req_lo, rpcmsg_rpc_queue_t)
+#define device_drvrpc_req_lo(_addr) iobuf_queue((_addr), iobuf_id_drvrpc, queue_id_drvrpc_req_dev_lo, rpcmsg_rpc_queue_t)
+
+#define devevt_queue_lo(_addr) iobuf_queue((_addr), iobuf_id_devevt_lo, queue_id_devevt_lo, rpcmsg_event_queue_t)
+
+static_assert(rpcmsg_iobuf_bytes(RPCMSG_RING_SIZE_DEFAULT, RPCMSG_RING_SIZE_DEFAULT, 0)
+	      <= IOBUF_PAGE_SIZE * IOBUF_NUM_PAGES,
 	      "Not enough of iobuf memory");
 
 #ifndef MASK
@@ -84,107 +548,856 @@ static_assert(sizeof(rpcmsg_iobuf_t) < 4096 * IOBUF_NUM_PAGES,
 #define QEMU_OP_START_VM    18
 #define QEMU_OP_REGISTER_PCI_DEV    19
 #define QEMU_OP_MMIO_REGION_CONFIG  20
+#define QEMU_OP_KICK_CONFIG         21
+
+/*
+ * Operations with this bit set carry a payload in the payload slice of the
+ * message, mr3 holds its length in bytes.
+ */
+#define QEMU_OP_PAYLOAD     32
+#define QEMU_OP_HAS_PAYLOAD(_op)    (!!((_op) & QEMU_OP_PAYLOAD))
+
+/* from driver to device: mr3 bytes of console output */
+#define QEMU_OP_PUTC_LOG_BUF        (QEMU_OP_PAYLOAD | QEMU_OP_PUTC_LOG)
+
+/* from device to driver: mr1 rpc_irq_update_t entries */
+#define QEMU_OP_SET_IRQ_BATCH       (QEMU_OP_PAYLOAD | QEMU_OP_SET_IRQ)
 
 #define QEMU_OP(_mr0)       BIT_FIELD_GET(_mr0, RPC_MR0_OP)
 
 #define RPC_MR0_COMMON_WIDTH            (RPC_MR0_OP_WIDTH + RPC_MR0_OP_SHIFT)
 #define RPC_MR0_COMMON_SHIFT            0
 
-/************************* defines for QEMU_OP_MMIO *************************/
+/************************* defines for QEMU_OP_MMIO *************************/
+
+#define RPC_MR0_MMIO_SLOT_WIDTH         6
+#define RPC_MR0_MMIO_SLOT_SHIFT         (RPC_MR0_COMMON_WIDTH + RPC_MR0_COMMON_SHIFT)
+
+#define RPC_MR0_MMIO_DIRECTION_WIDTH    1
+#define RPC_MR0_MMIO_DIRECTION_SHIFT    (RPC_MR0_MMIO_SLOT_WIDTH + RPC_MR0_MMIO_SLOT_SHIFT)
+
+#define RPC_MR0_MMIO_DIRECTION_READ     0
+#define RPC_MR0_MMIO_DIRECTION_WRITE    1
+
+#define RPC_MR0_MMIO_ADDR_SPACE_WIDTH   8
+#define RPC_MR0_MMIO_ADDR_SPACE_SHIFT   (RPC_MR0_MMIO_DIRECTION_WIDTH + RPC_MR0_MMIO_DIRECTION_SHIFT)
+
+#define AS_GLOBAL                       MASK(RPC_MR0_MMIO_ADDR_SPACE_WIDTH)
+#define AS_PCIDEV(__pcidev)             (__pcidev)
+
+#define RPC_MR0_MMIO_LENGTH_WIDTH       4
+#define RPC_MR0_MMIO_LENGTH_SHIFT       (RPC_MR0_MMIO_ADDR_SPACE_WIDTH + RPC_MR0_MMIO_ADDR_SPACE_SHIFT)
+
+/************************* defines for QEMU_OP_KICK_CONFIG *******************/
+
+/* mr1 holds the address, mr2 the data to match and mr3 the kick and flags */
+#define RPC_MR3_KICK_FLAGS_WIDTH        8
+#define RPC_MR3_KICK_FLAGS_SHIFT        0
+
+#define RPC_MR3_KICK_ID_WIDTH           8
+#define RPC_MR3_KICK_ID_SHIFT           (RPC_MR3_KICK_FLAGS_WIDTH + RPC_MR3_KICK_FLAGS_SHIFT)
+
+/************************* defines for QEMU_OP_SET_IRQ ***********************/
+#define RPC_IRQ_CLR	0
+#define RPC_IRQ_SET	1
+#define RPC_IRQ_PULSE	2
+
+/* QEMU_OP_SET_IRQ_BATCH payload entry */
+typedef struct rpc_irq_update {
+	uint32_t irq;
+	uint32_t op;	/* RPC_IRQ_* */
+} rpc_irq_update_t;
+
+/************************* payload ******************************************/
+
+/* Payload length of @msg, rpcmsg_payload_len_fn_t */
+static inline uint32_t vso_payload_len(rpcmsg_t const *msg)
+{
+	if (!QEMU_OP_HAS_PAYLOAD(QEMU_OP(msg->mr0))) {
+		return 0;
+	}
+
+	return msg->mr3;
+}
+
+/************************* priority lanes ***********************************/
+
+/*
+ * Each direction has a high and a low priority lane. Receivers always take
+ * from the high priority lane first, so that e.g. an interrupt does not wait
+ * behind a burst of console output. Messages are ordered within a lane only,
+ * so control and configuration events share the high priority lane with the
+ * interrupts that depend on them, e.g. an INTx raised right after the
+ * device has been registered.
+ */
+typedef enum vso_prio {
+	vso_prio_high = 0,
+	vso_prio_low,
+	vso_prio_last,
+} vso_prio_t;
+
+/* Lane of a message with @mr0 */
+static inline vso_prio_t vso_msg_prio(seL4_Word mr0)
+{
+	switch (QEMU_OP(mr0) & ~QEMU_OP_PAYLOAD) {
+	case QEMU_OP_MMIO:
+		/* vCPU faults stall a vCPU, native accesses of the VMM do not */
+		if (BIT_FIELD_GET(mr0, RPC_MR0_MMIO_ADDR_SPACE) == AS_GLOBAL) {
+			return vso_prio_high;
+		}
+		return vso_prio_low;
+	case QEMU_OP_SET_IRQ:
+	case QEMU_OP_START_VM:
+	case QEMU_OP_REGISTER_PCI_DEV:
+	case QEMU_OP_MMIO_REGION_CONFIG:
+	case QEMU_OP_KICK_CONFIG:
+		return vso_prio_high;
+	default:
+		return vso_prio_low;
+	}
+}
+
+/* Whether @msgs all go to the same lane, a bulk send uses a single lane */
+static inline bool vso_msgs_same_prio(rpcmsg_t const *msgs, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 1; i < n; i++) {
+		if (vso_msg_prio(msgs[i].mr0) != vso_msg_prio(msgs[0].mr0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*****************************************************************************/
+
+typedef enum vso_rpc_id {
+	vso_rpc_driver = 0,
+	vso_rpc_device_km,
+	vso_rpc_device,
+} vso_rpc_id_t;
+
+typedef struct vso_driver_rpc {
+	rpcmsg_rpc_queue_t request;
+	rpcmsg_rpc_queue_t request_lo;
+	rpcmsg_rpc_queue_t response;
+	/* used by the caller (the driver) */
+	rpcmsg_buffer_state_t buffer_state;
+} vso_driver_rpc_t;
+
+typedef rpcmsg_event_queue_t vso_device_event_t;
+
+/* Producer stalls of an end in flow controlled mode, see vso_rpc_stall() */
+typedef struct vso_flow_stats {
+	uint64_t stalls;
+	/* rpcmsg_ticks() */
+	uint64_t stall_ticks;
+	uint64_t max_stall_ticks;
+} vso_flow_stats_t;
+
+typedef struct vso_rpc {
+	/* requests from the driver to the device */
+	vso_driver_rpc_t driver_rpc;
+
+	/* requests from the device to driver */
+	vso_device_event_t device_event;
+	vso_device_event_t device_event_lo;
+
+	void (*doorbell)(void *doorbell_cookie);
+	void *doorbell_cookie;
+
+	/* doorbell suppression, see vso_rpc_arm() */
+	vso_rpc_id_t id;
+	volatile uint32_t *armed;
+	volatile uint32_t *peer_armed;
+
+	/* flow control, see vso_rpc_stall() */
+	int (*space_wait)(void *space_wait_cookie, uint32_t iter);
+	void *space_wait_cookie;
+	volatile uint32_t *space_waiters;
+	volatile uint32_t *peer_space_waiters;
+	vso_flow_stats_t flow_stats;
+
+	/* doorbell kicks, see vso_rpc_kick() */
+	volatile uint32_t *kicks;
+
+	/* interrupt lines, see vso_rpc_irq() */
+	volatile uint32_t *irq_level;
+	volatile uint32_t *irq_pulse;
+	volatile uint32_t *irq_pending;
+
+	/* coalesced MMIO writes, see vso_rpc_coalesce() */
+	rpcmsg_coalesced_t *coalesced;
+
+	/* register shadow, see rpcmsg_shadow_t */
+	rpcmsg_shadow_t *shadow;
+} vso_rpc_t;
+
+#define for_each_rpc_msg(_msg, _queue)	\
+	for ((_msg) = rpcmsg_receive((_queue)); (_msg); (_msg) = rpcmsg_receive((_queue)))
+
+#define for_each_rpc_resp(_msg, _id, _buf_state, _queue)		\
+	for ((_msg) = rpcmsg_receive_response((_queue), &_id);		\
+	     (_msg);							\
+	     rpcmsg_reclaim_buffer((_queue), (_buf_state), (_msg)),	\
+	     (_msg) = rpcmsg_receive_response((_queue), &_id))
+
+/* Request queue of the lane of @mr0 */
+static inline rpcmsg_rpc_queue_t *vso_request_lane(vso_rpc_t *rpc,
+						   seL4_Word mr0)
+{
+	if (vso_msg_prio(mr0) == vso_prio_high) {
+		return &rpc->driver_rpc.request;
+	}
+
+	return &rpc->driver_rpc.request_lo;
+}
+
+/* Event queue of the lane of @mr0 */
+static inline vso_device_event_t *vso_event_lane(vso_rpc_t *rpc,
+						 seL4_Word mr0)
+{
+	if (vso_msg_prio(mr0) == vso_prio_high) {
+		return &rpc->device_event;
+	}
+
+	return &rpc->device_event_lo;
+}
+
+/* Receive a request, high priority lane first */
+static inline rpcmsg_t *driver_rpc_receive(vso_rpc_t *rpc)
+{
+	rpcmsg_t *msg = rpcmsg_receive(&rpc->driver_rpc.request);
+
+	if (msg) {
+		return msg;
+	}
+
+	return rpcmsg_receive(&rpc->driver_rpc.request_lo);
+}
+
+/*
+ * Receive up to @n requests to @msgs, high priority lane first. Returns the
+ * number of requests received.
+ */
+static inline uint32_t driver_rpc_receive_bulk(vso_rpc_t *rpc,
+					       rpcmsg_t **msgs, uint32_t n)
+{
+	uint32_t count = rpcmsg_receive_bulk(&rpc->driver_rpc.request, msgs, n);
+
+	if (count < n) {
+		count += rpcmsg_receive_bulk(&rpc->driver_rpc.request_lo,
+					     msgs + count, n - count);
+	}
+
+	return count;
+}
+
+#define for_each_driver_rpc_req(_msg, _rpc)	\
+	for ((_msg) = driver_rpc_receive((_rpc)); (_msg); (_msg) = driver_rpc_receive((_rpc)))
+
+#define for_each_driver_rpc_resp(_msg, _id, _rpc)	\
+	for_each_rpc_resp((_msg), _id, &(_rpc)->driver_rpc.buffer_state, &(_rpc)->driver_rpc.response)
+
+#define for_each_device_event(_msg, _rpc)	\
+	for (;!device_event_rx((_rpc), &_msg);)
+
+/*
+ * Iterate device events in place, @_msg is a rpcmsg_t pointer to the slot of
+ * the event. Each event is released when the loop moves on, so the body must
+ * not break out of the loop.
+ */
+#define for_each_device_event_inplace(_msg, _rpc)			\
+	for ((_msg) = device_event_peek((_rpc)); (_msg);		\
+	     device_event_release((_rpc), (_msg)),			\
+	     (_msg) = device_event_peek((_rpc)))
+
+/* Same as for_each_device_event(), @_len receives the payload length */
+#define for_each_device_event_payload(_msg, _payload, _size, _len, _rpc)	\
+	for (;((_len) = device_event_rx_payload((_rpc), &(_msg), (_payload), (_size))) >= 0;)
+
+static inline int vso_doorbell(vso_rpc_t *rpc)
+{
+	if (!rpc || !rpc->doorbell) {
+		return -1;
+	}
+
+	if (rpc->peer_armed) {
+		uint32_t armed = VSO_ARMED_SLEEPING;
+
+		/* order the enqueue before the flag load, pairs with
+		 * vso_rpc_arm()
+		 */
+		rpcmsg_smp_mb();
+
+		switch (*rpc->peer_armed) {
+		case VSO_ARMED_POLLING:
+			/* the peer will see the message */
+			return 0;
+		case VSO_ARMED_SLEEPING:
+			/* only the first producer wakes the peer up; the
+			 * barrier above already orders the enqueue
+			 */
+			if (!atomic_compare_and_swap_relaxed(rpc->peer_armed, &armed,
+							     VSO_ARMED_POLLING)) {
+				return 0;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	rpc->doorbell(rpc->doorbell_cookie);
+
+	return 0;
+}
+
+/*
+ * Doorbell suppression
+ *
+ * Each end has an "armed" state in the iobuf header. A consumer sets it to
+ * polling while it drains its queues and to sleeping before going to sleep.
+ * Producers skip the doorbell while the peer is polling, and only the first
+ * producer after the peer went to sleep rings it, which moves the peer back
+ * to polling. The state starts as "always", so an end that never calls
+ * vso_rpc_disarm() gets a doorbell for every message, as before.
+ *
+ * Typical consumer loop:
+ *
+ *	vso_rpc_disarm(rpc);
+ *	do {
+ *		drain the queues;
+ *	} while (vso_rpc_arm(rpc));
+ *	sleep until the doorbell;
+ */
+static inline void vso_rpc_disarm(vso_rpc_t *rpc)
+{
+	if (rpc->armed) {
+		/* a late store costs at most a spurious doorbell */
+		atomic_store_relaxed(rpc->armed, VSO_ARMED_POLLING);
+	}
+}
+
+/*
+ * Doorbell kicks
+ *
+ * A guest write to an address the device registered with
+ * QEMU_OP_KICK_CONFIG only tells the device that something, typically a
+ * virtqueue, was kicked. The driver sets the bit of the kick in the iobuf
+ * header instead of sending a request, and rings the doorbell only if the
+ * bit was clear, so kicks coalesce until the device takes them. Kicks are
+ * not ordered against requests in flight.
+ */
+static inline int vso_rpc_kick(vso_rpc_t *rpc, unsigned int kick)
+{
+	uint32_t bit = 1U << (kick % 32);
+	uint32_t old;
+
+	if (!rpc->kicks || kick >= RPCMSG_KICK_MAX) {
+		return -1;
+	}
+
+	/* publishes the guest writes before the kick to the device */
+	old = __atomic_fetch_or(&rpc->kicks[kick / 32], bit, __ATOMIC_RELEASE);
+	if (old & bit) {
+		return 0;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/*
+ * Take the pending kicks 32 * @word to 32 * @word + 31, bit n of the result
+ * is kick 32 * @word + n.
+ */
+static inline uint32_t vso_rpc_kicks_take(vso_rpc_t *rpc, unsigned int word)
+{
+	if (!rpc->kicks || word >= RPCMSG_KICK_WORDS) {
+		return 0;
+	}
+
+	return __atomic_exchange_n(&rpc->kicks[word], 0, __ATOMIC_ACQUIRE);
+}
+
+static inline bool vso_rpc_kicks_pending(vso_rpc_t *rpc)
+{
+	unsigned int i;
+
+	if (!rpc->kicks) {
+		return false;
+	}
+
+	for (i = 0; i < RPCMSG_KICK_WORDS; i++) {
+		if (atomic_load_relaxed(&rpc->kicks[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Interrupt lines
+ *
+ * Instead of sending QEMU_OP_SET_IRQ, the device can set the state of a line
+ * below RPCMSG_IRQ_MAX in the iobuf header and mark the line pending. The
+ * doorbell is rung only if the line was not pending yet; the driver takes
+ * all pending lines in one pass and injects their latest state, so level
+ * changes the driver has not seen yet coalesce. Pulses are kept apart and
+ * are never lost.
+ */
+static inline int vso_rpc_irq(vso_rpc_t *rpc, unsigned int irq,
+			      unsigned int op)
+{
+	uint32_t bit = 1U << (irq % 32);
+	unsigned int word = irq / 32;
+	uint32_t old;
+
+	if (!rpc->irq_pending || irq >= RPCMSG_IRQ_MAX) {
+		return -1;
+	}
+
+	switch (op) {
+	case RPC_IRQ_SET:
+		__atomic_fetch_or(&rpc->irq_level[word], bit, __ATOMIC_RELAXED);
+		break;
+	case RPC_IRQ_CLR:
+		__atomic_fetch_and(&rpc->irq_level[word], ~bit, __ATOMIC_RELAXED);
+		break;
+	case RPC_IRQ_PULSE:
+		__atomic_fetch_or(&rpc->irq_pulse[word], bit, __ATOMIC_RELAXED);
+		break;
+	default:
+		return -1;
+	}
+
+	/* publishes the line state along with the pending bit */
+	old = __atomic_fetch_or(&rpc->irq_pending[word], bit, __ATOMIC_RELEASE);
+	if (old & bit) {
+		return 0;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/*
+ * Take the pending lines 32 * @word to 32 * @word + 31. Bit n of the result
+ * is line 32 * @word + n, @level and @pulse receive the state of the lines.
+ */
+static inline uint32_t vso_rpc_irqs_take(vso_rpc_t *rpc, unsigned int word,
+					 uint32_t *level, uint32_t *pulse)
+{
+	uint32_t pending;
+
+	if (!rpc->irq_pending || word >= RPCMSG_IRQ_WORDS) {
+		return 0;
+	}
+
+	pending = __atomic_exchange_n(&rpc->irq_pending[word], 0,
+				      __ATOMIC_ACQUIRE);
+	if (!pending) {
+		return 0;
+	}
+
+	*pulse = __atomic_fetch_and(&rpc->irq_pulse[word], ~pending,
+				    __ATOMIC_RELAXED) & pending;
+	*level = atomic_load_relaxed(&rpc->irq_level[word]);
+
+	return pending;
+}
+
+static inline bool vso_rpc_irqs_pending(vso_rpc_t *rpc)
+{
+	unsigned int i;
+
+	if (!rpc->irq_pending) {
+		return false;
+	}
+
+	for (i = 0; i < RPCMSG_IRQ_WORDS; i++) {
+		if (atomic_load_relaxed(&rpc->irq_pending[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Append a coalesced MMIO write, see rpcmsg_coalesced_t. The doorbell is
+ * rung only if the device has consumed everything before the write, so a
+ * burst of writes costs one doorbell. Returns -1 if the iobuf has no ring
+ * or the ring is full.
+ */
+static inline int vso_rpc_coalesce(vso_rpc_t *rpc, uint64_t addr,
+				   uint32_t len, uint64_t data)
+{
+	int64_t pos;
+
+	if (!rpc->coalesced) {
+		return -1;
+	}
+
+	pos = rpcmsg_coalesced_push(rpc->coalesced, addr, len, data);
+	if (pos < 0) {
+		return -1;
+	}
+
+	/* order the entry before the head load, pairs with vso_rpc_arm() */
+	rpcmsg_smp_mb();
+
+	if (atomic_load_relaxed(&rpc->coalesced->head) != (uint32_t)pos) {
+		/* the device has an older write to consume still */
+		return 0;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/* Take the oldest coalesced MMIO write, returns false if there is none */
+static inline bool vso_rpc_coalesced_rx(vso_rpc_t *rpc,
+					rpcmsg_coalesced_entry_t *entry)
+{
+	if (!rpc->coalesced) {
+		return false;
+	}
+
+	return rpcmsg_coalesced_pop(rpc->coalesced, entry);
+}
+
+/* Register of @len bytes at @offset of the shadow, NULL if out of range */
+static inline volatile void *vso_rpc_shadow_reg(vso_rpc_t *rpc,
+						uint32_t offset, uint32_t len)
+{
+	if (!rpc->shadow || (len != 1 && len != 2 && len != 4 && len != 8) ||
+	    offset % len || offset + len > RPCMSG_SHADOW_SIZE) {
+		return NULL;
+	}
+
+	return (volatile char *)rpc->shadow->regs + offset;
+}
+
+/*
+ * Read a register of @len bytes at @offset of the shadow to @value, and
+ * with @clear replace it with zero and tell the device. Called by the
+ * driver. Returns -1 if the register is outside the shadow.
+ */
+static inline int vso_rpc_shadow_read(vso_rpc_t *rpc, uint32_t offset,
+				      uint32_t len, bool clear,
+				      uint64_t *value)
+{
+	volatile void *reg = vso_rpc_shadow_reg(rpc, offset, len);
+	uint32_t bit = 1U << (offset / 8);
+	uint32_t old;
+
+	if (!reg) {
+		return -1;
+	}
+
+#define VSO_SHADOW_READ(_type)						\
+	(clear ? __atomic_exchange_n((volatile _type *)reg, 0,		\
+				     __ATOMIC_ACQ_REL) :		\
+		 __atomic_load_n((volatile _type *)reg, __ATOMIC_ACQUIRE))
+
+	switch (len) {
+	case 1:
+		*value = VSO_SHADOW_READ(uint8_t);
+		break;
+	case 2:
+		*value = VSO_SHADOW_READ(uint16_t);
+		break;
+	case 4:
+		*value = VSO_SHADOW_READ(uint32_t);
+		break;
+	default:
+		*value = VSO_SHADOW_READ(uint64_t);
+		break;
+	}
+
+#undef VSO_SHADOW_READ
+
+	if (!clear) {
+		return 0;
+	}
+
+	old = __atomic_fetch_or(&rpc->shadow->cleared, bit, __ATOMIC_RELEASE);
+	if (old & bit) {
+		return 0;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/*
+ * Update a register of @len bytes at @offset of the shadow, called by the
+ * device. With @set the bits of @value are set instead of the register
+ * being replaced, e.g. to raise ISR bits the driver may clear concurrently.
+ */
+static inline int vso_rpc_shadow_write(vso_rpc_t *rpc, uint32_t offset,
+				       uint32_t len, uint64_t value, bool set)
+{
+	volatile void *reg = vso_rpc_shadow_reg(rpc, offset, len);
+
+	if (!reg) {
+		return -1;
+	}
+
+#define VSO_SHADOW_WRITE(_type)						\
+	do {								\
+		if (set)						\
+			__atomic_fetch_or((volatile _type *)reg,	\
+					  (_type)value,			\
+					  __ATOMIC_RELEASE);		\
+		else							\
+			__atomic_store_n((volatile _type *)reg,		\
+					 (_type)value,			\
+					 __ATOMIC_RELEASE);		\
+	} while (0)
+
+	switch (len) {
+	case 1:
+		VSO_SHADOW_WRITE(uint8_t);
+		break;
+	case 2:
+		VSO_SHADOW_WRITE(uint16_t);
+		break;
+	case 4:
+		VSO_SHADOW_WRITE(uint32_t);
+		break;
+	default:
+		VSO_SHADOW_WRITE(uint64_t);
+		break;
+	}
+
+#undef VSO_SHADOW_WRITE
+
+	return 0;
+}
+
+/* Take the cleared bits of the shadow, see rpcmsg_shadow_t */
+static inline uint32_t vso_rpc_shadow_cleared_take(vso_rpc_t *rpc)
+{
+	if (!rpc->shadow) {
+		return 0;
+	}
+
+	return __atomic_exchange_n(&rpc->shadow->cleared, 0, __ATOMIC_ACQUIRE);
+}
+
+/* Are there messages for this end to consume? */
+static inline bool vso_rpc_pending(vso_rpc_t *rpc)
+{
+	if (rpc->id == vso_rpc_driver) {
+		return !rpcmsg_queue_empty(rpc->driver_rpc.response.queue) ||
+		       !rpcmsg_queue_empty(rpc->device_event.queue) ||
+		       !rpcmsg_queue_empty(rpc->device_event_lo.queue) ||
+		       vso_rpc_irqs_pending(rpc);
+	}
+
+	return !rpcmsg_queue_empty(rpc->driver_rpc.request.queue) ||
+	       !rpcmsg_queue_empty(rpc->driver_rpc.request_lo.queue) ||
+	       vso_rpc_kicks_pending(rpc) ||
+	       (rpc->coalesced && rpcmsg_coalesced_ready(rpc->coalesced)) ||
+	       (rpc->shadow && atomic_load_relaxed(&rpc->shadow->cleared));
+}
+
+/*
+ * Arm the doorbell before going to sleep. Returns true if messages arrived
+ * without a doorbell in the meantime; then the end has been disarmed again
+ * and the caller must poll instead of sleeping.
+ */
+static inline bool vso_rpc_arm(vso_rpc_t *rpc)
+{
+	if (!rpc->armed) {
+		return false;
+	}
+
+	atomic_store_relaxed(rpc->armed, VSO_ARMED_SLEEPING);
+
+	/* order the flag store before the queue loads, pairs with
+	 * vso_doorbell()
+	 */
+	rpcmsg_smp_mb();
+
+	if (vso_rpc_pending(rpc)) {
+		vso_rpc_disarm(rpc);
+		return true;
+	}
+
+	return false;
+}
 
-#define RPC_MR0_MMIO_SLOT_WIDTH         6
-#define RPC_MR0_MMIO_SLOT_SHIFT         (RPC_MR0_COMMON_WIDTH + RPC_MR0_COMMON_SHIFT)
+/*
+ * Flow control
+ *
+ * By default a send fails with -1 when the queue is full or, for requests,
+ * when all messages of the pool are in flight. If the end has a space_wait
+ * callback, the producer stalls instead: it registers itself as a space
+ * waiter in the iobuf header and retries the send, calling space_wait() with
+ * the retry count between the attempts, until the send succeeds or
+ * space_wait() returns non-zero.
+ *
+ * The consuming end calls vso_rpc_space_notify() after draining its queues,
+ * which rings the doorbell of the peer while it has space waiters. The time
+ * spent stalled is accounted in flow_stats.
+ *
+ * Only sends that can succeed once there is space stall, arguments that never
+ * fit still fail right away.
+ */
+static inline void vso_rpc_space_notify(vso_rpc_t *rpc)
+{
+	if (!rpc->peer_space_waiters || !rpc->doorbell) {
+		return;
+	}
 
-#define RPC_MR0_MMIO_DIRECTION_WIDTH    1
-#define RPC_MR0_MMIO_DIRECTION_SHIFT    (RPC_MR0_MMIO_SLOT_WIDTH + RPC_MR0_MMIO_SLOT_SHIFT)
+	/* order the dequeues before the waiter load, pairs with
+	 * vso_rpc_stall()
+	 */
+	rpcmsg_smp_mb();
 
-#define RPC_MR0_MMIO_DIRECTION_READ     0
-#define RPC_MR0_MMIO_DIRECTION_WRITE    1
+	if (*rpc->peer_space_waiters) {
+		rpc->doorbell(rpc->doorbell_cookie);
+	}
+}
 
-#define RPC_MR0_MMIO_ADDR_SPACE_WIDTH   8
-#define RPC_MR0_MMIO_ADDR_SPACE_SHIFT   (RPC_MR0_MMIO_DIRECTION_WIDTH + RPC_MR0_MMIO_DIRECTION_SHIFT)
+static inline uint64_t vso_rpc_stall_begin(vso_rpc_t *rpc)
+{
+	if (rpc->space_waiters) {
+		__atomic_fetch_add(rpc->space_waiters, 1, __ATOMIC_RELAXED);
+		/* order the waiter store before retrying the send, pairs with
+		 * vso_rpc_space_notify()
+		 */
+		rpcmsg_smp_mb();
+	}
 
-#define AS_GLOBAL                       MASK(RPC_MR0_MMIO_ADDR_SPACE_WIDTH)
-#define AS_PCIDEV(__pcidev)             (__pcidev)
+	return rpcmsg_ticks();
+}
 
-#define RPC_MR0_MMIO_LENGTH_WIDTH       4
-#define RPC_MR0_MMIO_LENGTH_SHIFT       (RPC_MR0_MMIO_ADDR_SPACE_WIDTH + RPC_MR0_MMIO_ADDR_SPACE_SHIFT)
+static inline void vso_rpc_stall_end(vso_rpc_t *rpc, uint64_t start)
+{
+	uint64_t ticks = rpcmsg_ticks() - start;
 
-/************************* defines for QEMU_OP_SET_IRQ ***********************/
-#define RPC_IRQ_CLR	0
-#define RPC_IRQ_SET	1
-#define RPC_IRQ_PULSE	2
+	if (rpc->space_waiters) {
+		/* nothing to publish, the count only gates notifications */
+		__atomic_fetch_sub(rpc->space_waiters, 1, __ATOMIC_RELAXED);
+	}
 
-/*****************************************************************************/
+	/* an end may have several producers */
+	rpcmsg_stat_add(&rpc->flow_stats.stalls, 1);
+	rpcmsg_stat_add(&rpc->flow_stats.stall_ticks, ticks);
+	rpcmsg_stat_max(&rpc->flow_stats.max_stall_ticks, ticks);
+}
 
-typedef struct vso_driver_rpc {
-	rpcmsg_rpc_queue_t request;
-	rpcmsg_rpc_queue_t response;
-	/* used by the caller (the driver) */
-	rpcmsg_buffer_state_t buffer_state;
-} vso_driver_rpc_t;
+/*
+ * Evaluate the send expression @_send, a negative value meaning no space,
+ * and stall until it succeeds if @_rpc is flow controlled.
+ */
+#define vso_rpc_stall(_rpc, _send)					\
+	({								\
+	 int _err = (_send);						\
+	 if (_err < 0 && (_rpc)->space_wait) {				\
+		uint64_t _start = vso_rpc_stall_begin(_rpc);		\
+		uint32_t _iter = 0;					\
+		while ((_err = (_send)) < 0 &&				\
+		       !(_rpc)->space_wait((_rpc)->space_wait_cookie,	\
+					   _iter++))			\
+			;						\
+		vso_rpc_stall_end((_rpc), _start);			\
+	 }								\
+	 _err;								\
+	 })
 
-typedef rpcmsg_event_queue_t vso_device_event_t;
+static inline int driver_rpc_request(vso_rpc_t *rpc, unsigned int op,
+				     seL4_Word mr0, seL4_Word mr1,
+				     seL4_Word mr2, seL4_Word mr3)
+{
+	int err;
 
-typedef struct vso_rpc {
-	/* requests from the driver to the device */
-	vso_driver_rpc_t driver_rpc;
+	rpc_assert(rpc);
 
-	/* requests from the device to driver */
-	vso_device_event_t device_event;
+	mr0 = BIT_FIELD_SET(mr0, RPC_MR0_OP, op);
 
-	void (*doorbell)(void *doorbell_cookie);
-	void *doorbell_cookie;
-} vso_rpc_t;
+	err = vso_rpc_stall(rpc, rpcmsg_request(vso_request_lane(rpc, mr0),
+						&rpc->driver_rpc.buffer_state,
+						mr0, mr1, mr2, mr3));
+	if (err < 0) {
+		return err;
+	}
 
-#define for_each_rpc_msg(_msg, _queue)	\
-	for ((_msg) = rpcmsg_receive((_queue)); (_msg); (_msg) = rpcmsg_receive((_queue)))
+	/* FIXME: return buffer id */
+	return vso_doorbell(rpc);
+}
 
-#define for_each_rpc_resp(_msg, _id, _buf_state, _queue)		\
-	for ((_msg) = rpcmsg_receive_response((_queue), &_id);		\
-	     (_msg);							\
-	     rpcmsg_reclaim_buffer((_queue), (_buf_state), (_msg)),	\
-	     (_msg) = rpcmsg_receive_response((_queue), &_id))
+/*
+ * Send @n requests with opcode @op in one go and ring the doorbell once. The
+ * opcode is written to each of @msgs. All of them must go to the same lane,
+ * e.g. MMIO requests of vCPUs and native accesses cannot be mixed.
+ */
+static inline int driver_rpc_request_bulk(vso_rpc_t *rpc, unsigned int op,
+					  rpcmsg_t *msgs, unsigned int n)
+{
+	unsigned int i;
+	int err;
 
-#define for_each_driver_rpc_req(_msg, _rpc)	\
-	for_each_rpc_msg(_msg, &(_rpc)->driver_rpc.request)
+	rpc_assert(rpc);
+	rpc_assert(msgs);
 
-#define for_each_driver_rpc_resp(_msg, _id, _rpc)	\
-	for_each_rpc_resp((_msg), _id, (_rpc)->driver_rpc.buffer_state, &(_rpc)->driver_rpc.response)
+	for (i = 0; i < n; i++) {
+		msgs[i].mr0 = BIT_FIELD_SET(msgs[i].mr0, RPC_MR0_OP, op);
+	}
 
-#define for_each_device_event(_msg, _rpc)	\
-	for (;!rpcmsg_event_rx(&(_rpc)->device_event, &_msg);)
+	if (!n) {
+		return 0;
+	}
 
-static inline int vso_doorbell(vso_rpc_t *rpc)
-{
-	if (!rpc || !rpc->doorbell) {
+	if (n > RPCMSG_BULK_MAX || n > rpc->driver_rpc.request.buffer->size ||
+	    !vso_msgs_same_prio(msgs, n)) {
 		return -1;
 	}
 
-	rpc->doorbell(rpc->doorbell_cookie);
+	err = vso_rpc_stall(rpc,
+			    rpcmsg_request_bulk(vso_request_lane(rpc, msgs[0].mr0),
+						&rpc->driver_rpc.buffer_state,
+						msgs, n));
+	if (err) {
+		return err;
+	}
 
-	return 0;
+	return vso_doorbell(rpc);
 }
 
-
-static inline int driver_rpc_request(vso_rpc_t *rpc, unsigned int op,
-				     seL4_Word mr0, seL4_Word mr1,
-				     seL4_Word mr2, seL4_Word mr3)
+/*
+ * Send a request with a payload operation @op and @len bytes of @payload.
+ * The payload length is passed in mr3.
+ */
+static inline int driver_rpc_request_payload(vso_rpc_t *rpc, unsigned int op,
+					     seL4_Word mr0, seL4_Word mr1,
+					     seL4_Word mr2, void const *payload,
+					     uint32_t len)
 {
 	int err;
 
 	rpc_assert(rpc);
+	rpc_assert(QEMU_OP_HAS_PAYLOAD(op));
 
 	mr0 = BIT_FIELD_SET(mr0, RPC_MR0_OP, op);
 
-	err = rpcmsg_request(&rpc->driver_rpc.request,
-			     rpc->driver_rpc.buffer_state,
-			     mr0, mr1, mr2, mr3);
+	if (len > rpc->driver_rpc.request.buffer->payload_size) {
+		return -1;
+	}
+
+	err = vso_rpc_stall(rpc,
+			    rpcmsg_request_payload(vso_request_lane(rpc, mr0),
+						   &rpc->driver_rpc.buffer_state,
+						   mr0, mr1, mr2, len,
+						   payload, len));
 	if (err < 0) {
 		return err;
 	}
 
-	/* FIXME: return buffer id */
 	return vso_doorbell(rpc);
 }
 
@@ -193,7 +1406,7 @@ static inline int driver_rpc_request_fwd(vso_rpc_t *dst, rpcmsg_t *msg)
 	rpc_assert(dst);
 	rpc_assert(msg);
 
-	return rpcmsg_forward(&dst->driver_rpc.request, msg);
+	return rpcmsg_forward(vso_request_lane(dst, msg->mr0), msg);
 }
 
 static inline int driver_rpc_reply(vso_rpc_t *rpc, rpcmsg_t *msg)
@@ -215,7 +1428,8 @@ static inline int driver_rpc_request_pending(vso_rpc_t *rpc)
 {
 	rpc_assert(rpc);
 
-	return rpcmsg_queue_empty(rpc->driver_rpc.request.queue);
+	return rpcmsg_queue_empty(rpc->driver_rpc.request.queue) &&
+	       rpcmsg_queue_empty(rpc->driver_rpc.request_lo.queue);
 }
 
 static inline int device_event_tx(vso_rpc_t *rpc, unsigned int op,
@@ -226,7 +1440,75 @@ static inline int device_event_tx(vso_rpc_t *rpc, unsigned int op,
 
 	mr0 = BIT_FIELD_SET(mr0, RPC_MR0_OP, op);
 
-	err = rpcmsg_event_tx(&rpc->device_event, mr0, mr1, mr2, mr3);
+	err = vso_rpc_stall(rpc, rpcmsg_event_tx(vso_event_lane(rpc, mr0),
+						 mr0, mr1, mr2, mr3));
+	if (err) {
+		return err;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/*
+ * Send @n events with opcode @op in one go and ring the doorbell once. The
+ * opcode is written to each of @msgs. All of them must go to the same lane.
+ */
+static inline int device_event_tx_bulk(vso_rpc_t *rpc, unsigned int op,
+				       rpcmsg_t *msgs, unsigned int n)
+{
+	unsigned int i;
+	int err;
+
+	rpc_assert(rpc);
+	rpc_assert(msgs);
+
+	for (i = 0; i < n; i++) {
+		msgs[i].mr0 = BIT_FIELD_SET(msgs[i].mr0, RPC_MR0_OP, op);
+	}
+
+	if (!n) {
+		return 0;
+	}
+
+	if (n > RPCMSG_BULK_MAX || n > rpc->device_event.queue->size ||
+	    !vso_msgs_same_prio(msgs, n)) {
+		return -1;
+	}
+
+	err = vso_rpc_stall(rpc, rpcmsg_event_tx_bulk(vso_event_lane(rpc, msgs[0].mr0),
+						      msgs, n));
+	if (err) {
+		return err;
+	}
+
+	return vso_doorbell(rpc);
+}
+
+/*
+ * Send an event with a payload operation @op and @len bytes of @payload.
+ * The payload length is passed in mr3.
+ */
+static inline int device_event_tx_payload(vso_rpc_t *rpc, unsigned int op,
+					  seL4_Word mr1, seL4_Word mr2,
+					  void const *payload, uint32_t len)
+{
+	rpcmsg_t msg = {
+		.mr0 = BIT_FIELD_SET(0, RPC_MR0_OP, op),
+		.mr1 = mr1,
+		.mr2 = mr2,
+		.mr3 = len,
+	};
+	int err;
+
+	rpc_assert(rpc);
+	rpc_assert(QEMU_OP_HAS_PAYLOAD(op));
+
+	if (len > rpc->device_event.buffer->payload_size) {
+		return -1;
+	}
+
+	err = vso_rpc_stall(rpc, rpcmsg_event_tx_payload(vso_event_lane(rpc, msg.mr0),
+							 &msg, payload, len));
 	if (err) {
 		return err;
 	}
@@ -234,6 +1516,80 @@ static inline int device_event_tx(vso_rpc_t *rpc, unsigned int op,
 	return vso_doorbell(rpc);
 }
 
+/*
+ * Receive a device event and its payload to @payload of @len bytes. Returns
+ * the payload length, or -1 if there are no events.
+ */
+static inline int device_event_rx_payload(vso_rpc_t *rpc, rpcmsg_t *msg,
+					  void *payload, uint32_t len)
+{
+	rpc_assert(rpc);
+
+	int rc = rpcmsg_event_rx_payload(&rpc->device_event, msg, payload, len,
+					 vso_payload_len);
+
+	if (rc >= 0) {
+		return rc;
+	}
+
+	return rpcmsg_event_rx_payload(&rpc->device_event_lo, msg, payload,
+				       len, vso_payload_len);
+}
+
+/*
+ * Zero-copy receive of a device event, high priority lane first, see
+ * rpcmsg_event_peek()
+ */
+static inline rpcmsg_t *device_event_peek(vso_rpc_t *rpc)
+{
+	rpcmsg_t *msg;
+
+	rpc_assert(rpc);
+
+	msg = rpcmsg_event_peek(&rpc->device_event);
+	if (msg) {
+		return msg;
+	}
+
+	return rpcmsg_event_peek(&rpc->device_event_lo);
+}
+
+/* Lane of @msg returned by device_event_peek(), told by its buffer */
+static inline vso_device_event_t *device_event_lane(vso_rpc_t *rpc,
+						    rpcmsg_t *msg)
+{
+	rpcmsg_buffer_t *b = rpc->device_event.buffer;
+
+	if (msg >= &b->messages[0].msg && msg < &b->messages[b->size].msg) {
+		return &rpc->device_event;
+	}
+
+	return &rpc->device_event_lo;
+}
+
+/* Payload slice of @msg returned by device_event_peek() */
+static inline void *device_event_payload(vso_rpc_t *rpc, rpcmsg_t *msg)
+{
+	return rpcmsg_msg_payload(device_event_lane(rpc, msg)->buffer, msg);
+}
+
+static inline void device_event_release(vso_rpc_t *rpc, rpcmsg_t *msg)
+{
+	rpcmsg_event_release(device_event_lane(rpc, msg), msg);
+}
+
+/* Receive a device event, high priority lane first */
+static inline int device_event_rx(vso_rpc_t *rpc, rpcmsg_t *msg)
+{
+	rpc_assert(rpc);
+
+	if (!rpcmsg_event_rx(&rpc->device_event, msg)) {
+		return 0;
+	}
+
+	return rpcmsg_event_rx(&rpc->device_event_lo, msg);
+}
+
 /* FIXME: convert these to synchronous RPC */
 static inline int device_rpc_req_start_vm(vso_rpc_t *rpc)
 {
@@ -253,6 +1609,18 @@ static inline int device_rpc_req_mmio_region_config(vso_rpc_t *rpc, uintptr_t gp
 	return device_event_tx(rpc, QEMU_OP_MMIO_REGION_CONFIG, 0, gpa, size, flags);
 }
 
+static inline int device_rpc_req_kick_config(vso_rpc_t *rpc, uintptr_t gpa,
+					     seL4_Word data, unsigned int kick,
+					     unsigned int flags)
+{
+	seL4_Word mr3 = 0;
+
+	mr3 = BIT_FIELD_SET(mr3, RPC_MR3_KICK_FLAGS, flags);
+	mr3 = BIT_FIELD_SET(mr3, RPC_MR3_KICK_ID, kick);
+
+	return device_event_tx(rpc, QEMU_OP_KICK_CONFIG, 0, gpa, data, mr3);
+}
+
 static inline int device_rpc_req_set_irqline(vso_rpc_t *rpc, seL4_Word irq)
 {
 	return device_event_tx(rpc, QEMU_OP_SET_IRQ, 0, irq, RPC_IRQ_SET, 0);
@@ -268,6 +1636,23 @@ static inline int device_rpc_req_pulse_irqline(vso_rpc_t *rpc, seL4_Word irq)
 	return device_event_tx(rpc, QEMU_OP_SET_IRQ, 0, irq, RPC_IRQ_PULSE, 0);
 }
 
+/* Change @n IRQ lines with one event */
+static inline int device_rpc_req_irq_batch(vso_rpc_t *rpc,
+					   rpc_irq_update_t const *updates,
+					   unsigned int n)
+{
+	return device_event_tx_payload(rpc, QEMU_OP_SET_IRQ_BATCH, n, 0, updates,
+				       n * sizeof(*updates));
+}
+
+/* Send @len bytes of console output with one request */
+static inline int driver_rpc_req_putc_log_buf(vso_rpc_t *rpc, char const *buf,
+					      uint32_t len)
+{
+	return driver_rpc_request_payload(rpc, QEMU_OP_PUTC_LOG_BUF, 0, 0, 0,
+					  buf, len);
+}
+
 static inline int driver_rpc_req_mmio_start(vso_rpc_t *rpc, unsigned int direction,
 					    unsigned int addr_space, unsigned int slot,
 					    seL4_Word addr, seL4_Word len, seL4_Word data)
@@ -293,34 +1678,124 @@ static inline int driver_rpc_ack_mmio_finish(vso_rpc_t *rpc, rpcmsg_t *msg, seL4
 	return driver_rpc_reply(rpc, msg);
 }
 
-typedef enum vso_rpc_id {
-	vso_rpc_driver = 0,
-	vso_rpc_device_km,
-	vso_rpc_device,
-} vso_rpc_id_t;
+/*
+ * Request latency tracing, see rpcmsg_trace_t. The stamps of a request are
+ * turned into per opcode histograms of the time spent in the request queue
+ * and notification path (queue), in the device (service), and in the
+ * response queue and notification path back (return).
+ */
+typedef enum vso_lat {
+	vso_lat_queue = 0,
+	vso_lat_service,
+	vso_lat_return,
+	vso_lat_last,
+} vso_lat_t;
 
-static inline int vso_driver_rpc_init(vso_rpc_id_t id, void *iobuf, vso_driver_rpc_t *drvrpc)
+#define VSO_TRACE_OPS	(1U << RPC_MR0_OP_WIDTH)
+
+typedef struct vso_trace {
+	rpcmsg_hist_t hist[VSO_TRACE_OPS][vso_lat_last];
+	/* requests with stamps out of order */
+	uint64_t invalid;
+} vso_trace_t;
+
+/*
+ * Stamp the completion of response @msg, once processed, and account its
+ * latencies to @trace. Does nothing unless the iobuf is traced.
+ */
+static inline void vso_trace_complete(vso_rpc_t *rpc, vso_trace_t *trace,
+				      rpcmsg_t *msg)
+{
+	rpcmsg_rpc_queue_t *resp = &rpc->driver_rpc.response;
+	rpcmsg_hist_t *hist;
+	rpcmsg_trace_t t;
+
+	if (!trace || !resp->trace) {
+		return;
+	}
+
+	rpcmsg_trace_msg(resp, msg, rpcmsg_ts_complete);
+	t = resp->trace[rpcmsg_msg_to_id(resp->buffer, msg)];
+
+	/* the device stamps are not trusted */
+	if (t.ts[rpcmsg_ts_receive] < t.ts[rpcmsg_ts_request] ||
+	    t.ts[rpcmsg_ts_reply] < t.ts[rpcmsg_ts_receive] ||
+	    t.ts[rpcmsg_ts_complete] < t.ts[rpcmsg_ts_reply]) {
+		trace->invalid++;
+		return;
+	}
+
+	hist = trace->hist[QEMU_OP(msg->mr0)];
+	rpcmsg_hist_add(&hist[vso_lat_queue],
+			t.ts[rpcmsg_ts_receive] - t.ts[rpcmsg_ts_request]);
+	rpcmsg_hist_add(&hist[vso_lat_service],
+			t.ts[rpcmsg_ts_reply] - t.ts[rpcmsg_ts_receive]);
+	rpcmsg_hist_add(&hist[vso_lat_return],
+			t.ts[rpcmsg_ts_complete] - t.ts[rpcmsg_ts_reply]);
+}
+
+/*
+ * Single producer/consumer opt-in, a bitmask of VSO_QUEUE_SP(qid) and
+ * VSO_QUEUE_SC(qid). Set VSO_QUEUE_SP(qid) only if this end enqueues to
+ * queue @qid from one thread at a time, and VSO_QUEUE_SC(qid) only if it
+ * dequeues from one thread at a time. The opt-in is local to this end of
+ * the connection.
+ */
+#define VSO_QUEUE_SP(_qid)	(RPCMSG_QF_SP << (2 * (_qid)))
+#define VSO_QUEUE_SC(_qid)	(RPCMSG_QF_SC << (2 * (_qid)))
+
+#define vso_queue_flags(_spsc, _qid) \
+	(((_spsc) >> (2 * (_qid))) & RPCMSG_QF_SPSC)
+
+static_assert(2 * queue_id_last <= 32, "SPSC mask too narrow");
+
+static inline int vso_driver_rpc_init_spsc(vso_rpc_id_t id, void *iobuf,
+					   vso_driver_rpc_t *drvrpc,
+					   unsigned int spsc)
 {
 	int err = 0;
 
 	rpc_assert(drvrpc);
 
+	/* the driver side must have laid out the iobuf */
+	if (rpcmsg_iobuf_check(iobuf, 0, 0, 0, 0)) {
+		return -1;
+	}
+
 	switch (id) {
 	case vso_rpc_driver:
 		drvrpc->request = driver_drvrpc_req(iobuf);
+		drvrpc->request_lo = driver_drvrpc_req_lo(iobuf);
 		drvrpc->response = driver_drvrpc_resp(iobuf);
 
 		rpcmsg_call_queue_init(&drvrpc->request);
+		rpcmsg_call_queue_init(&drvrpc->request_lo);
 		rpcmsg_reply_queue_init(&drvrpc->response);
 		rpcmsg_buffer_init(drvrpc->request.buffer);
+		rpcmsg_buffer_state_init(&drvrpc->buffer_state,
+					 drvrpc->request.buffer->size);
+
+		drvrpc->request.flags = vso_queue_flags(spsc, queue_id_drvrpc_req);
+		drvrpc->request_lo.flags = vso_queue_flags(spsc, queue_id_drvrpc_req_lo);
+		drvrpc->response.flags = vso_queue_flags(spsc, queue_id_drvrpc_resp);
 		break;
 	case vso_rpc_device_km:
 		drvrpc->request = device_km_drvrpc_req(iobuf);
+		drvrpc->request_lo = device_km_drvrpc_req_lo(iobuf);
 		drvrpc->response = device_km_drvrpc_resp(iobuf);
+
+		drvrpc->request.flags = vso_queue_flags(spsc, queue_id_drvrpc_req);
+		drvrpc->request_lo.flags = vso_queue_flags(spsc, queue_id_drvrpc_req_lo);
+		drvrpc->response.flags = vso_queue_flags(spsc, queue_id_drvrpc_resp);
 		break;
 	case vso_rpc_device:
 		drvrpc->request = device_drvrpc_req(iobuf);
+		drvrpc->request_lo = device_drvrpc_req_lo(iobuf);
 		drvrpc->response = device_drvrpc_resp(iobuf);
+
+		drvrpc->request.flags = vso_queue_flags(spsc, queue_id_drvrpc_req_dev);
+		drvrpc->request_lo.flags = vso_queue_flags(spsc, queue_id_drvrpc_req_dev_lo);
+		drvrpc->response.flags = vso_queue_flags(spsc, queue_id_drvrpc_resp);
 		break;
 	default:
 		err = -1;
@@ -330,21 +1805,79 @@ static inline int vso_driver_rpc_init(vso_rpc_id_t id, void *iobuf, vso_driver_r
 	return err;
 }
 
-static inline int vso_rpc_init(vso_rpc_t *rpc,
-			       vso_rpc_id_t id,
-			       void *iobuf,
-			       void (*doorbell)(void *doorbell_cookie),
-			       void *doorbell_cookie)
+static inline int vso_driver_rpc_init(vso_rpc_id_t id, void *iobuf, vso_driver_rpc_t *drvrpc)
+{
+	return vso_driver_rpc_init_spsc(id, iobuf, drvrpc, 0);
+}
+
+/*
+ * Set up doorbell suppression for the end @id. The VMM (driver) and the
+ * device kernel module consume the messages of their peer; the device
+ * user space is woken by the kernel module and has no flag of its own.
+ */
+static inline void vso_rpc_doorbell_init(vso_rpc_t *rpc, vso_rpc_id_t id,
+					 void *iobuf)
+{
+	rpcmsg_iobuf_t *hdr = iobuf;
+
+	rpc->id = id;
+	rpc->kicks = hdr->kicks;
+	rpc->irq_level = hdr->irq_level;
+	rpc->irq_pulse = hdr->irq_pulse;
+	rpc->irq_pending = hdr->irq_pending;
+	rpc->coalesced = NULL;
+	if (hdr->coalesced) {
+		rpc->coalesced = (rpcmsg_coalesced_t *)((char *)iobuf +
+							hdr->coalesced);
+	}
+	rpc->shadow = NULL;
+	if (hdr->shadow) {
+		rpc->shadow = (rpcmsg_shadow_t *)((char *)iobuf + hdr->shadow);
+	}
+
+	switch (id) {
+	case vso_rpc_driver:
+		rpc->armed = &hdr->armed[iobuf_end_driver];
+		rpc->peer_armed = &hdr->armed[iobuf_end_device];
+		rpc->space_waiters = &hdr->space_waiters[iobuf_end_driver];
+		rpc->peer_space_waiters = &hdr->space_waiters[iobuf_end_device];
+		break;
+	case vso_rpc_device_km:
+		rpc->armed = &hdr->armed[iobuf_end_device];
+		rpc->peer_armed = &hdr->armed[iobuf_end_driver];
+		rpc->space_waiters = &hdr->space_waiters[iobuf_end_device];
+		rpc->peer_space_waiters = &hdr->space_waiters[iobuf_end_driver];
+		break;
+	default:
+		rpc->armed = NULL;
+		rpc->peer_armed = &hdr->armed[iobuf_end_driver];
+		rpc->space_waiters = &hdr->space_waiters[iobuf_end_device];
+		rpc->peer_space_waiters = &hdr->space_waiters[iobuf_end_driver];
+		break;
+	}
+}
+
+static inline int vso_rpc_init_spsc(vso_rpc_t *rpc,
+				    vso_rpc_id_t id,
+				    void *iobuf,
+				    void (*doorbell)(void *doorbell_cookie),
+				    void *doorbell_cookie,
+				    unsigned int spsc)
 {
 	if (!rpc || !doorbell) {
 		return -1;
 	}
 
-	if (vso_driver_rpc_init(id, iobuf, &rpc->driver_rpc)) {
+	if (vso_driver_rpc_init_spsc(id, iobuf, &rpc->driver_rpc, spsc)) {
 		return -1;
 	}
 
 	rpc->device_event = devevt_queue(iobuf);
+	rpc->device_event.flags = vso_queue_flags(spsc, queue_id_devevt);
+	rpc->device_event_lo = devevt_queue_lo(iobuf);
+	rpc->device_event_lo.flags = vso_queue_flags(spsc, queue_id_devevt_lo);
+
+	vso_rpc_doorbell_init(rpc, id, iobuf);
 
 	rpc->doorbell = doorbell;
 	rpc->doorbell_cookie = doorbell_cookie;
@@ -355,3 +1888,12 @@ static inline int vso_rpc_init(vso_rpc_t *rpc,
 
 	return 0;
 }
+
+static inline int vso_rpc_init(vso_rpc_t *rpc,
+			       vso_rpc_id_t id,
+			       void *iobuf,
+			       void (*doorbell)(void *doorbell_cookie),
+			       void *doorbell_cookie)
+{
+	return vso_rpc_init_spsc(rpc, id, iobuf, doorbell, doorbell_cookie, 0);
+}
@@ -11,9 +11,18 @@
 #include <linux/bitmap.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/stddef.h>
 #include <linux/compiler_attributes.h>
+#include <linux/sched.h>
+#include <linux/preempt.h>
+#include <linux/irqflags.h>
+#include <linux/smp.h>
+#include <linux/timekeeping.h>
 #else
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -23,89 +32,136 @@
 
 typedef unsigned long seL4_Word;
 
+/*
+ * Atomics
+ *
+ * Every operation on shared memory states the weakest memory order that is
+ * still correct, see the comments at the call sites. The pairing is:
+ *
+ *  - entries are claimed with a relaxed CAS on the tail marker, after an
+ *    acquire load of the opposite head marker (or entry sequence) that
+ *    orders the accesses to the entries after those of the other side
+ *  - entries are committed with a release CAS on the head marker (or a
+ *    store-release of the entry sequence); later commit CASes by other
+ *    threads continue the release sequence
+ *
+ * On AArch64 the compiler emits either ARMv8.1 LSE instructions (CAS, LDADD,
+ * LDSET) or LL/SC loops for these, see the RpcAtomics build option. In Linux
+ * the kernel's own selection applies.
+ */
+#define atomic_load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
 #define atomic_load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, i)  __atomic_store_n(ptr, i, __ATOMIC_RELAXED)
 #define atomic_store_release(ptr, i)  __atomic_store_n(ptr, i, __ATOMIC_RELEASE)
 
 #ifndef __KERNEL__
-#define atomic_compare_and_swap(_p, _o, _n) __atomic_compare_exchange_n(_p, _o, _n, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define rpcmsg_smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 #else
-#define atomic_compare_and_swap(_p, _o, _n) (arch_cmpxchg((_p), *(_o), (_n)) == *(_o))
+#define rpcmsg_smp_mb() smp_mb()
 #endif
 
-#if defined(__KERNEL__)
-#define rpc_assert(_cond) BUG_ON(!(_cond))
+/*
+ * Compare-and-swap *@_p from *@_o to @_n with the given order on success. On
+ * failure the current value is stored to *@_o with relaxed order, so retry
+ * loops continue from it without reloading.
+ */
+#ifndef __KERNEL__
+#define atomic_compare_and_swap_relaxed(_p, _o, _n) __atomic_compare_exchange_n(_p, _o, _n, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define atomic_compare_and_swap_acquire(_p, _o, _n) __atomic_compare_exchange_n(_p, _o, _n, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#define atomic_compare_and_swap_release(_p, _o, _n) __atomic_compare_exchange_n(_p, _o, _n, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
 #else
-#define rpc_assert assert
+#define atomic_compare_and_swap_relaxed(_p, _o, _n) try_cmpxchg_relaxed((_p), (_o), (_n))
+#define atomic_compare_and_swap_acquire(_p, _o, _n) try_cmpxchg_acquire((_p), (_o), (_n))
+#define atomic_compare_and_swap_release(_p, _o, _n) try_cmpxchg_release((_p), (_o), (_n))
 #endif
 
-#ifndef DECLARE_BITMAP
-#define DECLARE_BITMAP(name, bits)	\
-	unsigned long name[((bits) + (8 * sizeof(unsigned long)) - 1) / (8 * sizeof(unsigned long))]
+/* Instrumentation hook invoked on every failed compare-and-swap of the ring
+ * markers. By default user space counts the retries of each thread for the
+ * queue telemetry; benchmarks may override it.
+ */
+#ifndef rpcmsg_cas_retry_hook
+#if defined(__KERNEL__)
+#define rpcmsg_cas_retry_hook() do { } while (0)
+#define rpcmsg_cas_retries_get() 0
+#else
+static __thread uint64_t rpcmsg_cas_retries __maybe_unused;
+#define rpcmsg_cas_retry_hook() do { rpcmsg_cas_retries++; } while (0)
+#define rpcmsg_cas_retries_get() rpcmsg_cas_retries
+#endif
 #endif
 
-#ifndef min
-#define min(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#ifndef rpcmsg_cas_retries_get
+#define rpcmsg_cas_retries_get() 0
 #endif
 
-#if !defined(__KERNEL__)
-#define find_first_zero_bit _find_first_zero_bit
-static inline
-unsigned long _find_first_zero_bit(const unsigned long *addr,
-				   unsigned long size)
-{
-	unsigned long i, v, n = size;
-	unsigned long n_bits = (8 * sizeof(unsigned long));
+/* atomic_compare_and_swap_<@_mo>() of a ring marker, counting retries */
+#define rpcmsg_marker_cas(_p, _o, _n, _mo)				\
+	({								\
+		bool __ok = atomic_compare_and_swap_##_mo((_p), (_o), (_n)); \
+		if (!__ok)						\
+			rpcmsg_cas_retry_hook();			\
+		__ok;							\
+	})
 
-	for (i = 0; i * n_bits < n; i++) {
-		v = ~addr[i];
-		if (v) {
-			n = min(i * n_bits + __builtin_ctzl(v), n);
-			break;
-		}
-	}
-	return n;
-}
+#if defined(__KERNEL__)
+#define rpc_assert(_cond) BUG_ON(!(_cond))
+#else
+#define rpc_assert assert
 #endif
 
-#if !defined(__KERNEL__)
-#define set_bit _set_bit
+#ifndef min
+#define min(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#endif
 
-static inline
-void _set_bit(unsigned long nr, volatile unsigned long *addr)
-{
-	unsigned long n_bits = (8 * sizeof(unsigned long));
-	unsigned long mask = (1UL << (nr % n_bits));
+#ifndef max
+#define max(_a, _b) ((_a) > (_b) ? (_a) : (_b))
+#endif
 
-	addr += nr / n_bits;
+/*****************************************************************************/
 
-	__sync_fetch_and_or(addr, mask);
-}
-#endif
+/*
+ * Ring depth and message pool size are set per connection at run time (see
+ * rpcmsg_iobuf_layout() in rpc.h). The ring depth must be a power of two.
+ */
+#define RPCMSG_RING_SIZE_DEFAULT 32
+#define RPCMSG_RING_SIZE_MIN 2
+#define RPCMSG_RING_SIZE_MAX 1024
 
-#if !defined(__KERNEL__)
-#define clear_bit _clear_bit
+/* Upper bound for the number of entries processed by one bulk operation */
+#define RPCMSG_BULK_MAX 32
 
-static inline
-void _clear_bit(unsigned long nr, volatile unsigned long *addr)
-{
-	unsigned long n_bits = (8 * sizeof(unsigned long));
-	unsigned long mask = (1UL << (nr % n_bits));
+/* Payload slice size per message, a multiple of RPCMSG_PAYLOAD_ALIGN */
+#define RPCMSG_PAYLOAD_ALIGN 8
+#define RPCMSG_PAYLOAD_SIZE_MAX 4096
 
-	addr += nr / n_bits;
+static_assert((RPCMSG_RING_SIZE_MAX & (RPCMSG_RING_SIZE_MAX - 1)) == 0,
+	      "message buffer size must be power of two");
+static_assert(RPCMSG_RING_SIZE_MAX <= (1U << 16),
+	      "message ids must fit to ring entries");
 
-	__sync_fetch_and_and(addr, ~mask);
-}
+/*
+ * Shared memory layout
+ *
+ * With RPCMSG_CACHELINE_LAYOUT the producer and consumer bounds, the ring
+ * and every message slot start on a cache line of their own, so that the
+ * producers' and consumers' CASes and concurrent writes to adjacent message
+ * slots do not invalidate each other's cache lines. The default layout is
+ * packed. Both ends of a connection must use the same layout; the layout is
+ * recorded in the iobuf header and verified by rpcmsg_iobuf_check().
+ */
+#ifndef RPCMSG_CACHELINE_LAYOUT
+#define RPCMSG_CACHELINE_LAYOUT 0
 #endif
 
-/*****************************************************************************/
+#define RPCMSG_CACHELINE_SIZE 64
 
-#define RPCMSG_BUFFER_SIZE 32
-#define RPCMSG_BUFFER_MASK (RPCMSG_BUFFER_SIZE - 1)
-#define RPCMSG_HTD_MAX ((RPCMSG_BUFFER_SIZE) / 4)
+#if RPCMSG_CACHELINE_LAYOUT
+#define RPCMSG_LAYOUT_ALIGN RPCMSG_CACHELINE_SIZE
+#else
+#define RPCMSG_LAYOUT_ALIGN 8
+#endif
 
-static_assert(RPCMSG_BUFFER_SIZE != 0 ||
-	      (RPCMSG_BUFFER_SIZE & RPCMSG_BUFFER_MASK) == 0,
-	      "message buffer size must be power of two");
+#define __rpcmsg_aligned __attribute__ ((aligned (RPCMSG_LAYOUT_ALIGN)))
 
 typedef struct {
 	seL4_Word mr0;
@@ -114,8 +170,20 @@ typedef struct {
 	seL4_Word mr3;
 } rpcmsg_t;
 
+/* message buffer entry, padded to a cache line in the cache line layout */
+typedef struct rpcmsg_slot {
+	rpcmsg_t msg;
+} __rpcmsg_aligned rpcmsg_slot_t;
+
+/*
+ * Message buffer. With a non-zero @payload_size every message has a payload
+ * slice of that many bytes, located after the message array. The slice of
+ * a message is owned by whoever owns the message.
+ */
 typedef struct rpcmsg_buffer {
-	rpcmsg_t messages[RPCMSG_BUFFER_SIZE];
+	uint32_t size;
+	uint32_t payload_size;
+	rpcmsg_slot_t messages[] __rpcmsg_aligned;
 } rpcmsg_buffer_t;
 
 struct _rpcmsg_marker {
@@ -135,11 +203,37 @@ typedef struct rpcmsg_queue_bound {
 } rpcmsg_queue_bound_t;
 
 typedef struct rpcmsg_queue_t {
-	volatile rpcmsg_queue_bound_t prod;
-	volatile rpcmsg_queue_bound_t cons;
-	uint16_t ring[RPCMSG_BUFFER_SIZE];
+	volatile rpcmsg_queue_bound_t prod __rpcmsg_aligned;
+	volatile rpcmsg_queue_bound_t cons __rpcmsg_aligned;
+	uint32_t size __rpcmsg_aligned;
+	uint32_t mask;
+	uint32_t flags;		/* RPCMSG_QUEUE_F_* */
+	uint16_t ring[] __rpcmsg_aligned;
 } rpcmsg_queue_t;
 
+/* Shared memory ABI, the VMM and the device VM kernel module must agree */
+#if RPCMSG_CACHELINE_LAYOUT
+static_assert(sizeof(rpcmsg_slot_t) == RPCMSG_CACHELINE_SIZE,
+	      "message slot must fill a cache line");
+static_assert(offsetof(rpcmsg_buffer_t, messages) == RPCMSG_CACHELINE_SIZE,
+	      "unexpected rpcmsg_buffer_t layout");
+static_assert(offsetof(rpcmsg_queue_t, prod) == 0 &&
+	      offsetof(rpcmsg_queue_t, cons) == 1 * RPCMSG_CACHELINE_SIZE &&
+	      offsetof(rpcmsg_queue_t, size) == 2 * RPCMSG_CACHELINE_SIZE &&
+	      offsetof(rpcmsg_queue_t, ring) == 3 * RPCMSG_CACHELINE_SIZE,
+	      "unexpected rpcmsg_queue_t layout");
+#else
+static_assert(sizeof(rpcmsg_slot_t) == sizeof(rpcmsg_t),
+	      "message slot must not be padded");
+static_assert(offsetof(rpcmsg_buffer_t, messages) == 8,
+	      "unexpected rpcmsg_buffer_t layout");
+static_assert(offsetof(rpcmsg_queue_t, prod) == 0 &&
+	      offsetof(rpcmsg_queue_t, cons) == 16 &&
+	      offsetof(rpcmsg_queue_t, size) == 32 &&
+	      offsetof(rpcmsg_queue_t, ring) == 48,
+	      "unexpected rpcmsg_queue_t layout");
+#endif
+
 typedef void rpcmsg_enqueue_elem_fn_t(rpcmsg_queue_t *q,
 				      rpcmsg_buffer_t *b,
 				      uint32_t ring_index,
@@ -149,14 +243,133 @@ typedef void rpcmsg_dequeue_elem_fn_t(rpcmsg_queue_t *q,
 				      uint32_t ring_index,
 				      void * const rx_data);
 
+#define RPCMSG_ALIGN(_n) \
+	(((_n) + RPCMSG_LAYOUT_ALIGN - 1UL) & ~(RPCMSG_LAYOUT_ALIGN - 1UL))
+
+/* Bytes of shared memory needed by a queue of @size entries */
+#define rpcmsg_queue_bytes(_size) \
+	RPCMSG_ALIGN(sizeof(rpcmsg_queue_t) + (_size) * sizeof(uint16_t))
+
+/*
+ * Sequence queues
+ *
+ * With RPCMSG_QUEUE_F_SEQ every ring entry has a sequence number of its own
+ * in an array after the ring, as in Vyukov's bounded MPMC queue. Entry @pos
+ * is free for a producer when its sequence is @pos, published to the
+ * consumers when it is @pos + 1, and handed back for the next lap by the
+ * consumer setting it to @pos + size. Producers and consumers still claim
+ * entries with a CAS on their tail marker, but each entry is published with
+ * a plain store-release. An enqueue is visible as soon as it is written
+ * rather than once all earlier enqueues have committed, and there is no
+ * commit CAS on a shared head marker, which is not maintained at all.
+ *
+ * The mode is a property of the queue in shared memory, chosen by the
+ * driver side in rpcmsg_iobuf_layout(). The single producer/consumer handle
+ * flags have no effect on a sequence queue.
+ */
+#define RPCMSG_QUEUE_F_SEQ	(1U << 0)
+
+/* Entries are stored inline in the buffer slot of the same index and the
+ * queue has no ring array, see the event queues
+ */
+#define RPCMSG_QUEUE_F_INLINE	(1U << 1)
+
+/* Bytes of the entry sequence array of a queue of @size entries */
+#define rpcmsg_queue_seq_bytes(_size) \
+	RPCMSG_ALIGN((_size) * sizeof(uint32_t))
+
+static inline
+bool rpcmsg_queue_is_seq(rpcmsg_queue_t const * const q)
+{
+	return q->flags & RPCMSG_QUEUE_F_SEQ;
+}
+
+/* Entries of the ring array of @q */
+static inline
+uint32_t rpcmsg_queue_ring_entries(rpcmsg_queue_t const * const q)
+{
+	return (q->flags & RPCMSG_QUEUE_F_INLINE) ? 0 : q->size;
+}
+
+static inline
+volatile uint32_t *rpcmsg_queue_seq(rpcmsg_queue_t const * const q)
+{
+	return (volatile uint32_t *)((char *)q +
+				     rpcmsg_queue_bytes(rpcmsg_queue_ring_entries(q)));
+}
+
+/* Bytes of shared memory needed by a buffer of @size messages, each with
+ * a payload slice of @payload_size bytes
+ */
+#define rpcmsg_buffer_bytes(_size, _payload_size) \
+	RPCMSG_ALIGN(sizeof(rpcmsg_buffer_t) +			\
+		     (_size) * (sizeof(rpcmsg_slot_t) + (_payload_size)))
+
+/* Constant expression forms, for compile time checks of configurations */
+#define RPCMSG_SIZE_VALID(_size)					\
+	((_size) >= RPCMSG_RING_SIZE_MIN && (_size) <= RPCMSG_RING_SIZE_MAX && \
+	 !((_size) & ((_size) - 1)))
+#define RPCMSG_PAYLOAD_SIZE_VALID(_payload_size)			\
+	((_payload_size) <= RPCMSG_PAYLOAD_SIZE_MAX &&			\
+	 !((_payload_size) % RPCMSG_PAYLOAD_ALIGN))
+
+static inline
+bool rpcmsg_size_valid(uint32_t size)
+{
+	return RPCMSG_SIZE_VALID(size);
+}
+
+static inline
+bool rpcmsg_payload_size_valid(uint32_t payload_size)
+{
+	return RPCMSG_PAYLOAD_SIZE_VALID(payload_size);
+}
+
+/* Set the queue depth and RPCMSG_QUEUE_F_* @flags. Must be done before the
+ * queue is initialized.
+ */
+__maybe_unused static void rpcmsg_queue_setup(rpcmsg_queue_t * const q,
+					      uint32_t size, uint32_t flags)
+{
+	rpc_assert(rpcmsg_size_valid(size));
+
+	q->size = size;
+	q->mask = size - 1;
+	q->flags = flags;
+}
+
+/* Set the message pool and payload slice sizes. Must be done before the
+ * buffer is initialized.
+ */
+__maybe_unused static void rpcmsg_buffer_setup(rpcmsg_buffer_t * const b,
+					       uint32_t size,
+					       uint32_t payload_size)
+{
+	rpc_assert(size && size <= RPCMSG_RING_SIZE_MAX);
+	rpc_assert(rpcmsg_payload_size_valid(payload_size));
+
+	b->size = size;
+	b->payload_size = payload_size;
+}
+
 __maybe_unused static void rpcmsg_queue_init(rpcmsg_queue_t * const q)
 {
-	memset(q, 0, sizeof(*q));
+	memset((void *)&q->prod, 0, sizeof(q->prod));
+	memset((void *)&q->cons, 0, sizeof(q->cons));
+	memset(q->ring, 0, rpcmsg_queue_ring_entries(q) * sizeof(q->ring[0]));
+
+	if (rpcmsg_queue_is_seq(q)) {
+		volatile uint32_t *seq = rpcmsg_queue_seq(q);
+		uint32_t i;
+
+		for (i = 0; i < q->size; i++)
+			seq[i] = i;
+	}
 }
 
 __maybe_unused static void rpcmsg_buffer_init(rpcmsg_buffer_t * const b)
 {
-	memset(b, 0, sizeof(*b));
+	memset(b->messages, 0, b->size * sizeof(b->messages[0]));
 }
 
 static inline
@@ -164,7 +377,14 @@ bool rpcmsg_queue_full(rpcmsg_queue_t const * const q)
 {
 	rpc_assert(q);
 
-	return (RPCMSG_BUFFER_SIZE + q->cons.tail.val - q->prod.tail.val) == 0;
+	if (rpcmsg_queue_is_seq(q)) {
+		uint32_t pos = q->prod.tail.marker.pos;
+
+		/* the consumer of the previous lap is not done with it */
+		return (int32_t)(rpcmsg_queue_seq(q)[pos & q->mask] - pos) < 0;
+	}
+
+	return (q->size + q->cons.tail.val - q->prod.tail.val) == 0;
 }
 
 static inline
@@ -172,9 +392,22 @@ bool rpcmsg_queue_empty(rpcmsg_queue_t *q)
 {
 	rpc_assert(q);
 
+	if (rpcmsg_queue_is_seq(q)) {
+		uint32_t pos = q->cons.tail.marker.pos;
+
+		return (int32_t)(rpcmsg_queue_seq(q)[pos & q->mask] - pos - 1) < 0;
+	}
+
 	return q->prod.head.val == q->cons.head.val;
 }
 
+/* Marker that moves as consumers make room, for producers waiting on it */
+static inline
+volatile uint64_t *rpcmsg_queue_space_marker(rpcmsg_queue_t *q)
+{
+	return rpcmsg_queue_is_seq(q) ? &q->cons.tail.raw : &q->cons.head.raw;
+}
+
 static inline
 uint16_t rpcmsg_msg_to_id(rpcmsg_buffer_t *buffer, rpcmsg_t *msg)
 {
@@ -183,8 +416,8 @@ uint16_t rpcmsg_msg_to_id(rpcmsg_buffer_t *buffer, rpcmsg_t *msg)
 	rpc_assert(buffer);
 	rpc_assert(msg);
 
-	id = msg - buffer->messages;
-	rpc_assert(id < RPCMSG_BUFFER_SIZE);
+	id = (rpcmsg_slot_t *)msg - buffer->messages;
+	rpc_assert(id < buffer->size);
 
 	return id;
 }
@@ -193,152 +426,1021 @@ static inline
 rpcmsg_t *rpcmsg_id_to_msg(rpcmsg_buffer_t * const buffer, uint16_t id)
 {
 	rpc_assert(buffer);
-	rpc_assert(id < RPCMSG_BUFFER_SIZE);
+	rpc_assert(id < buffer->size);
+
+	return &buffer->messages[id].msg;
+}
+
+/* Payload slice of message @id, NULL if the buffer has no payload area */
+static inline
+void *rpcmsg_payload(rpcmsg_buffer_t * const buffer, uint16_t id)
+{
+	rpc_assert(buffer);
+	rpc_assert(id < buffer->size);
+
+	if (!buffer->payload_size) {
+		return NULL;
+	}
+
+	return (char *)&buffer->messages[buffer->size] +
+	       (size_t)id * buffer->payload_size;
+}
 
-	return &buffer->messages[id];
+static inline
+void *rpcmsg_msg_payload(rpcmsg_buffer_t * const buffer, rpcmsg_t *msg)
+{
+	return rpcmsg_payload(buffer, rpcmsg_msg_to_id(buffer, msg));
+}
+
+/*
+ * Wait policy
+ *
+ * A thread waiting for other producers/consumers to commit goes through the
+ * following stages, each lasting the given number of wait iterations:
+ *
+ *   spin     busy loop with a CPU relax hint (yield/pause) in between
+ *   wfe      AArch64 wait-for-event on the monitored head marker; a store
+ *            to the marker by the committing thread clears the exclusive
+ *            monitor and wakes the waiter, so no explicit SEV is needed
+ *   backoff  exponentially increasing runs of CPU relax hints
+ *   block    give up the CPU: the block callback of the wait if any (the
+ *            VMM waits on a semaphore posted by rpc_run()), else the
+ *            policy's block callback if set, otherwise cond_resched() in
+ *            Linux outside atomic context and sched_yield() (seL4_Yield()
+ *            in the VMM) elsewhere
+ *
+ * The policy may be changed at run time through rpcmsg_wait_policy. The
+ * number of times each stage is reached is counted in rpcmsg_wait_stats.
+ * The counters are not atomic and thus approximate under contention. Every
+ * program using the queues defines both once with RPCMSG_WAIT_DEFINE().
+ */
+#if defined(__aarch64__) && !defined(RPCMSG_WAIT_USE_WFE)
+#if defined(__KERNEL__)
+#define RPCMSG_WAIT_USE_WFE 1
+#else
+/* EL0 WFE may trap depending on how the kernel configures SCTLR_EL1.nTWE */
+#define RPCMSG_WAIT_USE_WFE 0
+#endif
+#endif
+
+#if defined(__aarch64__) && RPCMSG_WAIT_USE_WFE
+#define RPCMSG_WAIT_WFE_DEFAULT 16
+#else
+#define RPCMSG_WAIT_WFE_DEFAULT 0
+#endif
+
+#define RPCMSG_WAIT_SPIN_DEFAULT 64
+#define RPCMSG_WAIT_BACKOFF_DEFAULT 10
+#define RPCMSG_WAIT_BACKOFF_SHIFT_MAX 10
+
+typedef enum rpcmsg_wait_stage {
+	rpcmsg_wait_spin = 0,
+	rpcmsg_wait_wfe,
+	rpcmsg_wait_backoff,
+	rpcmsg_wait_block,
+	rpcmsg_wait_last,
+} rpcmsg_wait_stage_t;
+
+typedef struct rpcmsg_wait_policy {
+	uint32_t spin;
+	uint32_t wfe;
+	uint32_t backoff;
+	void (*block)(void *cookie);
+	void *cookie;
+} rpcmsg_wait_policy_t;
+
+typedef struct rpcmsg_wait_stats {
+	unsigned long waits;
+	unsigned long stage[rpcmsg_wait_last];
+} rpcmsg_wait_stats_t;
+
+extern rpcmsg_wait_policy_t rpcmsg_wait_policy;
+extern rpcmsg_wait_stats_t rpcmsg_wait_stats;
+
+#define RPCMSG_WAIT_DEFINE()						\
+	rpcmsg_wait_policy_t rpcmsg_wait_policy = {			\
+		.spin = RPCMSG_WAIT_SPIN_DEFAULT,			\
+		.wfe = RPCMSG_WAIT_WFE_DEFAULT,				\
+		.backoff = RPCMSG_WAIT_BACKOFF_DEFAULT,			\
+	};								\
+	rpcmsg_wait_stats_t rpcmsg_wait_stats
+
+static inline
+void rpcmsg_cpu_relax(void)
+{
+#if defined(__KERNEL__)
+	cpu_relax();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#elif defined(__x86_64__) || defined(__i386__)
+	asm volatile("pause" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+/* Wait for an event unless *@addr already differs from @old */
+static inline
+void rpcmsg_cpu_wfe(volatile const uint64_t *addr, uint64_t old)
+{
+#if defined(__aarch64__) && RPCMSG_WAIT_USE_WFE
+	uint64_t v;
+
+	/* arm the exclusive monitor so that a store to @addr wakes us up */
+	asm volatile("ldxr %0, [%1]" : "=&r" (v) : "r" (addr) : "memory");
+	if (v == old)
+		asm volatile("wfe" ::: "memory");
+#else
+	rpcmsg_cpu_relax();
+#endif
+}
+
+static inline
+void rpcmsg_plat_block(void)
+{
+#if defined(__KERNEL__)
+	/* the device may wait in atomic or interrupt context */
+	if (!in_atomic() && !irqs_disabled())
+		cond_resched();
+	else
+		cpu_relax();
+#else
+	sched_yield();
+#endif
+}
+
+static inline
+void rpcmsg_wait_stat(rpcmsg_wait_stage_t stage)
+{
+	rpcmsg_wait_stats.stage[stage]++;
+}
+
+/*
+ * Wait iteration @iter for *@addr to change from @old. Iterations are
+ * counted from zero for every wait. In the block stage @block is called
+ * with @cookie if set.
+ */
+static inline
+void rpcmsg_plat_wait(volatile const uint64_t *addr, uint64_t old,
+		      uint32_t iter, void (*block)(void *cookie), void *cookie)
+{
+	const rpcmsg_wait_policy_t *p = &rpcmsg_wait_policy;
+	uint32_t i, n;
+
+	if (!iter)
+		rpcmsg_wait_stats.waits++;
+
+	if (iter < p->spin) {
+		if (!iter)
+			rpcmsg_wait_stat(rpcmsg_wait_spin);
+		rpcmsg_cpu_relax();
+		return;
+	}
+	iter -= p->spin;
+
+	if (iter < p->wfe) {
+		if (!iter)
+			rpcmsg_wait_stat(rpcmsg_wait_wfe);
+		rpcmsg_cpu_wfe(addr, old);
+		return;
+	}
+	iter -= p->wfe;
+
+	if (iter < p->backoff) {
+		if (!iter)
+			rpcmsg_wait_stat(rpcmsg_wait_backoff);
+		n = 1U << min(iter + 1, (uint32_t)RPCMSG_WAIT_BACKOFF_SHIFT_MAX);
+		for (i = 0; i < n; i++)
+			rpcmsg_cpu_relax();
+		return;
+	}
+	iter -= p->backoff;
+
+	if (!iter)
+		rpcmsg_wait_stat(rpcmsg_wait_block);
+
+	if (block)
+		block(cookie);
+	else if (p->block)
+		p->block(p->cookie);
+	else
+		rpcmsg_plat_block();
+}
+
+/* Wait iteration @iter for *@addr to change from @old */
+static inline
+void rpcmsg_plat_yield(volatile const uint64_t *addr, uint64_t old,
+		       uint32_t iter)
+{
+	rpcmsg_plat_wait(addr, old, iter, NULL, NULL);
+}
+
+/*
+ * Monotonic time stamps for stall and latency accounting, in units of
+ * rpcmsg_ticks_freq() per second. AArch64 reads the virtual counter
+ * directly, which needs no system call and gives the VMM and the device VM
+ * kernel the same time base, so stamps of the two ends can be compared.
+ */
+static inline
+uint64_t rpcmsg_ticks(void)
+{
+#if defined(__aarch64__)
+	uint64_t v;
+
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r" (v) :: "memory");
+	return v;
+#elif defined(__KERNEL__)
+	return ktime_get_ns();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
 static inline
-void rpcmsg_plat_yield(void)
+uint64_t rpcmsg_ticks_freq(void)
 {
-	/* FIXME: sleep/yield/schedule */
+#if defined(__aarch64__)
+	uint64_t v;
+
+	asm volatile("mrs %0, cntfrq_el0" : "=r" (v));
+	return v;
+#else
+	return 1000000000ULL;
+#endif
+}
+
+static inline
+uint64_t rpcmsg_ticks_to_ns(uint64_t ticks)
+{
+	uint64_t freq = rpcmsg_ticks_freq();
+
+	if (freq == 1000000000ULL)
+		return ticks;
+
+	return (ticks / freq) * 1000000000ULL +
+	       (ticks % freq) * 1000000000ULL / freq;
+}
+
+/*
+ * Request tracing
+ *
+ * With tracing enabled every message of a request-reply pool has a slot of
+ * rpcmsg_ticks() stamps in shared memory, taken on send, on receive by the
+ * device (the last receive wins if the request is forwarded), on reply and
+ * on completion by the requester.
+ */
+typedef enum rpcmsg_ts {
+	rpcmsg_ts_request = 0,
+	rpcmsg_ts_receive,
+	rpcmsg_ts_reply,
+	rpcmsg_ts_complete,
+	rpcmsg_ts_last,
+} rpcmsg_ts_t;
+
+typedef struct rpcmsg_trace {
+	uint64_t ts[rpcmsg_ts_last];
+} rpcmsg_trace_t;
+
+static inline
+void rpcmsg_trace_stamp(rpcmsg_trace_t *trace, uint16_t id, rpcmsg_ts_t ts)
+{
+	if (trace)
+		trace[id].ts[ts] = rpcmsg_ticks();
+}
+
+/*
+ * Log2 histogram of rpcmsg_ticks() intervals, bucket i counts intervals in
+ * [2^i, 2^(i + 1)). Not atomic, each histogram has a single writer.
+ */
+#define RPCMSG_HIST_BUCKETS 32
+
+typedef struct rpcmsg_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[RPCMSG_HIST_BUCKETS];
+} rpcmsg_hist_t;
+
+static inline
+void rpcmsg_hist_add(rpcmsg_hist_t *h, uint64_t val)
+{
+	unsigned int i = val ? 63 - __builtin_clzll(val) : 0;
+
+	h->bucket[min(i, RPCMSG_HIST_BUCKETS - 1U)]++;
+	h->count++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/* Upper bound of the bucket of the @permille quantile of @h */
+static inline
+uint64_t rpcmsg_hist_quantile(rpcmsg_hist_t const *h, unsigned int permille)
+{
+	uint64_t rank = (h->count * permille + 999) / 1000;
+	uint64_t seen = 0, limit;
+	unsigned int i;
+
+	for (i = 0; i < RPCMSG_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen && seen >= rank) {
+			limit = (2ULL << i) - 1;
+			return limit < h->max ? limit : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/* Maximum distance between tail and head of a queue bound */
+static inline
+uint32_t rpcmsg_htd_max(rpcmsg_queue_t const * const q)
+{
+	return q->size / 4 ? q->size / 4 : 1;
 }
 
 static inline
 void rpcmsg_tail_wait(volatile const rpcmsg_queue_bound_t *bound,
-		      rpcmsg_marker_t *tail)
+		      uint32_t htd_max, rpcmsg_marker_t *tail)
+{
+	rpcmsg_marker_t head;
+	uint32_t iter = 0;
+
+	/* throttling only, the claim orders the entry accesses */
+	for (;;) {
+		head.raw = atomic_load_relaxed(&bound->head.raw);
+		if (tail->marker.pos - head.marker.pos <= htd_max)
+			break;
+
+		rpcmsg_plat_yield(&bound->head.raw, head.raw, iter++);
+		tail->raw = atomic_load_relaxed(&bound->tail.raw);
+	}
+}
+
+/*
+ * Count the consecutive entries, up to @n, from @pos on whose sequence is
+ * their position plus @off. @diff tells how the sequence of the first entry
+ * not counted differs: negative if that entry is not ready yet, positive if
+ * @pos is stale.
+ */
+static inline
+uint32_t rpcmsg_seq_ready(rpcmsg_queue_t *q, uint32_t pos, uint32_t off,
+			  uint32_t n, int32_t *diff)
 {
-	while (tail->marker.pos - bound->head.marker.pos > RPCMSG_HTD_MAX) {
-		rpcmsg_plat_yield();
-		tail->raw = atomic_load_acquire(&bound->tail.raw);
+	volatile uint32_t *seq = rpcmsg_queue_seq(q);
+	uint32_t i;
+
+	*diff = 0;
+	for (i = 0; i < n; i++) {
+		*diff = (int32_t)(atomic_load_acquire(&seq[(pos + i) & q->mask]) -
+				  (pos + i + off));
+		if (*diff)
+			break;
 	}
+
+	return i;
 }
 
+/*
+ * Claim up to @n consecutive entries of a sequence queue from @bound: free
+ * entries (@off 0) for a producer, published ones (@off 1) for a consumer.
+ * Semantics are the same as in rpcmsg_acquire_prod_entries().
+ */
 static inline
-int rpcmsg_acquire_prod_entry(rpcmsg_queue_t *q, uint32_t *entry)
+uint32_t rpcmsg_seq_acquire_entries(rpcmsg_queue_t *q,
+				    volatile rpcmsg_queue_bound_t *bound,
+				    uint32_t off, uint32_t n, bool exact,
+				    uint32_t *entry)
+{
+	rpcmsg_marker_t ot, nt;
+	uint32_t count;
+	int32_t diff;
+
+	ot.raw = atomic_load_relaxed(&bound->tail.raw);
+
+	for (;;) {
+		/* acquire loads of the sequences, pair with rpcmsg_seq_publish() */
+		count = rpcmsg_seq_ready(q, ot.marker.pos, off, n, &diff);
+		if (count < n && diff > 0) {
+			/* somebody else claimed the entries meanwhile */
+			rpcmsg_cas_retry_hook();
+			ot.raw = atomic_load_relaxed(&bound->tail.raw);
+			continue;
+		}
+		if (exact && count < n)
+			count = 0;
+		if (!count) {
+			/* full or empty */
+			break;
+		}
+
+		nt.marker.pos = ot.marker.pos + count;
+		nt.marker.count = ot.marker.count + count;
+		if (rpcmsg_marker_cas(&bound->tail.raw, (uint64_t *)(uintptr_t)&ot.raw,
+				      nt.raw, relaxed))
+			break;
+	}
+
+	*entry = ot.marker.pos;
+
+	return count;
+}
+
+/*
+ * Publish @n entries from @entry claimed from a sequence queue: to the
+ * consumers (@off 1), or back to the producers (@off size).
+ */
+static inline
+void rpcmsg_seq_publish(rpcmsg_queue_t *q, uint32_t entry, uint32_t n,
+			uint32_t off)
+{
+	volatile uint32_t *seq = rpcmsg_queue_seq(q);
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		atomic_store_release(&seq[(entry + i) & q->mask], entry + i + off);
+}
+
+/*
+ * Claim up to @n consecutive producer entries with a single CAS. If @exact is
+ * set, either all @n entries are claimed or none. Returns the number of
+ * entries claimed, the first one in @entry.
+ */
+static inline
+uint32_t rpcmsg_acquire_prod_entries(rpcmsg_queue_t *q, uint32_t n,
+				     bool exact, uint32_t *entry)
 {
 	rpcmsg_marker_t ot, nt;
-	uint32_t entries;
-	int ret = 0;
+	uint32_t entries, count;
+
+	if (rpcmsg_queue_is_seq(q))
+		return rpcmsg_seq_acquire_entries(q, &q->prod, 0, n, exact, entry);
 
-	ot.raw = atomic_load_acquire(&q->prod.tail.raw);
+	ot.raw = atomic_load_relaxed(&q->prod.tail.raw);
 
 	do {
 		/* wait for producer head/tail distance */
-		rpcmsg_tail_wait(&q->prod, &ot);
-
-		/* check size */
-		entries = RPCMSG_BUFFER_SIZE + q->cons.head.marker.pos - ot.marker.pos;
-		if (!entries) {
-			ret = -1;
+		rpcmsg_tail_wait(&q->prod, rpcmsg_htd_max(q), &ot);
+
+		/* check size; the consumers are done with the entries up to
+		 * their head, pairs with the release in rpcmsg_commit_update_bulk()
+		 */
+		entries = q->size + atomic_load_acquire(&q->cons.head.marker.pos) -
+			  ot.marker.pos;
+		count = min(n, entries);
+		if (exact && count < n)
+			count = 0;
+		if (!count) {
+			/* full */
 			break;
 		}
 
-		nt.marker.pos = ot.marker.pos + 1;
-		nt.marker.count = ot.marker.count + 1;
-	} while (!atomic_compare_and_swap(&q->prod.tail.raw, (uint64_t *)(uintptr_t)&ot.raw, nt.raw));
+		nt.marker.pos = ot.marker.pos + count;
+		nt.marker.count = ot.marker.count + count;
+	} while (!rpcmsg_marker_cas(&q->prod.tail.raw, (uint64_t *)(uintptr_t)&ot.raw,
+				    nt.raw, relaxed));
 
 	*entry = ot.marker.pos;
 
-	return ret;
+	return count;
 }
 
+/*
+ * Claim up to @n consecutive consumer entries with a single CAS. Semantics
+ * are the same as in rpcmsg_acquire_prod_entries().
+ */
 static inline
-int rpcmsg_acquire_cons_entry(rpcmsg_queue_t *q, uint32_t *entry)
+uint32_t rpcmsg_acquire_cons_entries(rpcmsg_queue_t *q, uint32_t n,
+				     bool exact, uint32_t *entry)
 {
 	rpcmsg_marker_t ot, nt;
-	uint32_t entries;
-	int ret = 0;
+	uint32_t entries, count;
 
-	ot.raw = atomic_load_acquire(&q->cons.tail.raw);
+	if (rpcmsg_queue_is_seq(q))
+		return rpcmsg_seq_acquire_entries(q, &q->cons, 1, n, exact, entry);
+
+	ot.raw = atomic_load_relaxed(&q->cons.tail.raw);
 
 	do {
 		/* wait for consumer head/tail distance */
-		rpcmsg_tail_wait(&q->cons, &ot);
-
-		entries = q->prod.head.marker.pos - ot.marker.pos;
-		if (!entries) {
+		rpcmsg_tail_wait(&q->cons, rpcmsg_htd_max(q), &ot);
+
+		/* the entries up to the producer head are written, pairs with
+		 * the release in rpcmsg_commit_update_bulk()
+		 */
+		entries = atomic_load_acquire(&q->prod.head.marker.pos) -
+			  ot.marker.pos;
+		count = min(n, entries);
+		if (exact && count < n)
+			count = 0;
+		if (!count) {
 			/* empty */
-			ret = -1;
 			break;
 		}
 
-		nt.marker.pos = ot.marker.pos + 1;
-		nt.marker.count = ot.marker.count + 1;
+		nt.marker.pos = ot.marker.pos + count;
+		nt.marker.count = ot.marker.count + count;
+
+	} while (!rpcmsg_marker_cas(&q->cons.tail.raw, (uint64_t *)(uintptr_t)&ot.raw,
+				    nt.raw, relaxed));
+
+	*entry = ot.marker.pos;
+
+	return count;
+}
+
+static inline
+int rpcmsg_acquire_prod_entry(rpcmsg_queue_t *q, uint32_t *entry)
+{
+	return rpcmsg_acquire_prod_entries(q, 1, true, entry) ? 0 : -1;
+}
+
+static inline
+int rpcmsg_acquire_cons_entry(rpcmsg_queue_t *q, uint32_t *entry)
+{
+	return rpcmsg_acquire_cons_entries(q, 1, true, entry) ? 0 : -1;
+}
+
+/* Commit @n entries claimed earlier from @bound */
+static inline
+void rpcmsg_commit_update_bulk(volatile rpcmsg_queue_bound_t *bound, uint32_t n)
+{
+	rpcmsg_marker_t t, oh, nh;
+
+	/*
+	 * If there are other enqueues/dequeues in progress that
+	 * might preceded us, then don't update marker position, just updater
+	 * count.
+	 */
+	oh.raw = atomic_load_relaxed(&bound->head.raw);
+
+	do {
+		t.raw = atomic_load_relaxed(&bound->tail.raw);
+
+		nh.raw = oh.raw;
+		nh.marker.count += n;
+		if (nh.marker.count == t.marker.count)
+			nh.marker.pos = t.marker.pos;
+
+		/* release our entry accesses; whoever moves the position later
+		 * continues the release sequence of every commit before it
+		 */
+	} while (!rpcmsg_marker_cas(&bound->head.raw, (uint64_t *)(uintptr_t)&oh.raw,
+				    nh.raw, release));
+}
+
+static inline
+void rpcmsg_commit_update(volatile rpcmsg_queue_bound_t *bound)
+{
+	rpcmsg_commit_update_bulk(bound, 1);
+}
+
+/* Commit @n producer entries from @entry claimed earlier */
+static inline
+void rpcmsg_commit_prod(rpcmsg_queue_t *q, uint32_t entry, uint32_t n)
+{
+	if (rpcmsg_queue_is_seq(q))
+		rpcmsg_seq_publish(q, entry, n, 1);
+	else
+		rpcmsg_commit_update_bulk(&q->prod, n);
+}
+
+/* Commit @n consumer entries from @entry claimed earlier */
+static inline
+void rpcmsg_commit_cons(rpcmsg_queue_t *q, uint32_t entry, uint32_t n)
+{
+	if (rpcmsg_queue_is_seq(q))
+		rpcmsg_seq_publish(q, entry, n, q->size);
+	else
+		rpcmsg_commit_update_bulk(&q->cons, n);
+}
+
+static inline
+int rpcmsg_enqueue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+		   rpcmsg_enqueue_elem_fn_t enqueue_fn, void const * const data)
+{
+	uint32_t entry;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(enqueue_fn);
+	rpc_assert(data);
+
+	if (rpcmsg_acquire_prod_entry(q, &entry)) {
+		/* full */
+		return -1;
+	}
+
+	/* enqueue entry */
+	enqueue_fn(q, b, entry & q->mask, data);
+	rpcmsg_commit_prod(q, entry, 1);
+
+	return 0;
+}
+
+static inline
+int rpcmsg_dequeue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+		   rpcmsg_dequeue_elem_fn_t dequeue_fn, void * const data)
+{
+	uint32_t entry;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(dequeue_fn);
+	rpc_assert(data);
+
+	if (rpcmsg_acquire_cons_entry(q, &entry)) {
+		/* empty */
+		return -1;
+	}
+
+	/* dequeue entry */
+	dequeue_fn(q, b, entry & q->mask, data);
+	rpcmsg_commit_cons(q, entry, 1);
+
+	return 0;
+}
+
+/*
+ * Enqueue @n elements of @stride bytes each from @data. Either all elements
+ * are enqueued (returns 0) or none (returns -1).
+ */
+static inline
+int rpcmsg_enqueue_bulk(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			rpcmsg_enqueue_elem_fn_t enqueue_fn,
+			void const * const data, size_t stride, uint32_t n)
+{
+	uint32_t entry;
+	uint32_t i;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(enqueue_fn);
+	rpc_assert(data);
+
+	if (!n) {
+		return 0;
+	}
+
+	if (!rpcmsg_acquire_prod_entries(q, n, true, &entry)) {
+		/* not enough room */
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		enqueue_fn(q, b, (entry + i) & q->mask,
+			   (char const *)data + i * stride);
+	}
+	rpcmsg_commit_prod(q, entry, n);
+
+	return 0;
+}
+
+/*
+ * Dequeue up to @n elements of @stride bytes each to @data. Returns the
+ * number of elements dequeued, zero if the queue is empty.
+ */
+static inline
+uint32_t rpcmsg_dequeue_bulk(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			     rpcmsg_dequeue_elem_fn_t dequeue_fn,
+			     void * const data, size_t stride, uint32_t n)
+{
+	uint32_t entry;
+	uint32_t count;
+	uint32_t i;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(dequeue_fn);
+	rpc_assert(data);
+
+	count = rpcmsg_acquire_cons_entries(q, n, false, &entry);
+
+	for (i = 0; i < count; i++) {
+		dequeue_fn(q, b, (entry + i) & q->mask,
+			   (char *)data + i * stride);
+	}
+	if (count) {
+		rpcmsg_commit_cons(q, entry, count);
+	}
+
+	return count;
+}
+
+/*
+ * Single producer / single consumer fast path
+ *
+ * A side of a queue that is only ever driven by one thread can skip the
+ * tail CAS and the commit CAS altogether: it owns its bound, so it only has
+ * to load-acquire the opposite head and store-release its own tail and head
+ * once the entries are written or read. The markers are kept in the same
+ * form as on the MPMC path, so the other side of the queue may still use
+ * the MPMC path, and the two ends of a connection choose independently.
+ * The flags are a property of the queue handle, see vso_rpc_init_spsc().
+ */
+#define RPCMSG_QF_SP	(1U << 0)	/* single producer */
+#define RPCMSG_QF_SC	(1U << 1)	/* single consumer */
+#define RPCMSG_QF_SPSC	(RPCMSG_QF_SP | RPCMSG_QF_SC)
+
+static inline
+void rpcmsg_spsc_publish(volatile rpcmsg_queue_bound_t *bound,
+			 rpcmsg_marker_t m, uint32_t n)
+{
+	m.marker.pos += n;
+	m.marker.count += n;
+
+	/* only the head is read for synchronisation by the other side */
+	atomic_store_relaxed(&bound->tail.raw, m.raw);
+	atomic_store_release(&bound->head.raw, m.raw);
+}
+
+/* Single producer rpcmsg_enqueue_bulk() */
+static inline
+int rpcmsg_sp_enqueue_bulk(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			   rpcmsg_enqueue_elem_fn_t enqueue_fn,
+			   void const * const data, size_t stride, uint32_t n)
+{
+	rpcmsg_marker_t t;
+	uint32_t cons_head;
+	uint32_t i;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(enqueue_fn);
+	rpc_assert(data);
+
+	if (!n) {
+		return 0;
+	}
+
+	/* the producer bound is ours, nobody else writes it */
+	t.raw = q->prod.tail.raw;
+	cons_head = atomic_load_acquire(&q->cons.head.marker.pos);
+
+	if (q->size + cons_head - t.marker.pos < n) {
+		/* not enough room */
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		enqueue_fn(q, b, (t.marker.pos + i) & q->mask,
+			   (char const *)data + i * stride);
+	}
+	rpcmsg_spsc_publish(&q->prod, t, n);
+
+	return 0;
+}
+
+/* Single consumer rpcmsg_dequeue_bulk() */
+static inline
+uint32_t rpcmsg_sc_dequeue_bulk(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+				rpcmsg_dequeue_elem_fn_t dequeue_fn,
+				void * const data, size_t stride, uint32_t n)
+{
+	rpcmsg_marker_t t;
+	uint32_t prod_head;
+	uint32_t count;
+	uint32_t i;
+
+	rpc_assert(q);
+	rpc_assert(b);
+	rpc_assert(dequeue_fn);
+	rpc_assert(data);
+
+	/* the consumer bound is ours, nobody else writes it */
+	t.raw = q->cons.tail.raw;
+	prod_head = atomic_load_acquire(&q->prod.head.marker.pos);
+
+	count = min(n, prod_head - t.marker.pos);
+
+	for (i = 0; i < count; i++) {
+		dequeue_fn(q, b, (t.marker.pos + i) & q->mask,
+			   (char *)data + i * stride);
+	}
+	if (count) {
+		rpcmsg_spsc_publish(&q->cons, t, count);
+	}
+
+	return count;
+}
+
+/*
+ * Queue telemetry
+ *
+ * Optional counters that live in shared memory next to the queues, so that
+ * both ends can read them. To be cheap enough to leave on, the counters are
+ * sharded: a thread (a CPU in the kernel) updates the cache line of its own
+ * shard with relaxed atomics, and readers add the shards up with
+ * rpcmsg_queue_stats_read().
+ */
+#define RPCMSG_STATS_SHARDS 8
+
+typedef struct rpcmsg_stats {
+	uint64_t enqueues;
+	uint64_t dequeues;
+	uint64_t full;
+	uint64_t empty;
+	uint64_t cas_retries;
+	uint64_t max_occupancy;
+} rpcmsg_stats_t;
+
+typedef struct rpcmsg_stats_shard {
+	rpcmsg_stats_t s;
+} __attribute__ ((aligned (RPCMSG_CACHELINE_SIZE))) rpcmsg_stats_shard_t;
+
+typedef struct rpcmsg_queue_stats {
+	rpcmsg_stats_shard_t shard[RPCMSG_STATS_SHARDS];
+} rpcmsg_queue_stats_t;
+
+static inline
+unsigned int rpcmsg_stats_shard_id(void)
+{
+#if defined(__KERNEL__)
+	return raw_smp_processor_id() % RPCMSG_STATS_SHARDS;
+#else
+	static unsigned int next_shard;
+	static __thread unsigned int shard;	/* shard id + 1 */
+
+	if (!shard) {
+		shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) %
+			RPCMSG_STATS_SHARDS + 1;
+	}
+
+	return shard - 1;
+#endif
+}
+
+#define rpcmsg_stat_add(_p, _n) __atomic_fetch_add((_p), (_n), __ATOMIC_RELAXED)
+
+static inline
+void rpcmsg_stat_max(uint64_t *p, uint64_t val)
+{
+	uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (val > old &&
+	       !__atomic_compare_exchange_n(p, &old, val, true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Account an enqueue of @n entries, @n == 0 if the queue was full */
+static inline
+void rpcmsg_stats_tx(rpcmsg_queue_stats_t *stats, rpcmsg_queue_t const *q,
+		     uint32_t n, uint64_t cas_retries)
+{
+	rpcmsg_stats_t *s;
+
+	if (!stats)
+		return;
+
+	s = &stats->shard[rpcmsg_stats_shard_id()].s;
+
+	if (n) {
+		rpcmsg_stat_add(&s->enqueues, n);
+		rpcmsg_stat_max(&s->max_occupancy,
+				q->prod.tail.marker.pos -
+				(rpcmsg_queue_is_seq(q) ? q->cons.tail.marker.pos :
+				 q->cons.head.marker.pos));
+	} else {
+		rpcmsg_stat_add(&s->full, 1);
+	}
+
+	if (cas_retries)
+		rpcmsg_stat_add(&s->cas_retries, cas_retries);
+}
+
+/* Account a dequeue of @n entries, @n == 0 if the queue was empty */
+static inline
+void rpcmsg_stats_rx(rpcmsg_queue_stats_t *stats, uint32_t n,
+		     uint64_t cas_retries)
+{
+	rpcmsg_stats_t *s;
+
+	if (!stats)
+		return;
+
+	s = &stats->shard[rpcmsg_stats_shard_id()].s;
+
+	if (n)
+		rpcmsg_stat_add(&s->dequeues, n);
+	else
+		rpcmsg_stat_add(&s->empty, 1);
+
+	if (cas_retries)
+		rpcmsg_stat_add(&s->cas_retries, cas_retries);
+}
+
+/* Sum up the shards of @stats to @out */
+static inline
+void rpcmsg_queue_stats_read(rpcmsg_queue_stats_t *stats, rpcmsg_stats_t *out)
+{
+	rpcmsg_stats_t *s;
+	unsigned int i;
+
+	memset(out, 0, sizeof(*out));
+
+	if (!stats)
+		return;
+
+	for (i = 0; i < RPCMSG_STATS_SHARDS; i++) {
+		s = &stats->shard[i].s;
+		out->enqueues += __atomic_load_n(&s->enqueues, __ATOMIC_RELAXED);
+		out->dequeues += __atomic_load_n(&s->dequeues, __ATOMIC_RELAXED);
+		out->full += __atomic_load_n(&s->full, __ATOMIC_RELAXED);
+		out->empty += __atomic_load_n(&s->empty, __ATOMIC_RELAXED);
+		out->cas_retries += __atomic_load_n(&s->cas_retries, __ATOMIC_RELAXED);
+		out->max_occupancy = max(out->max_occupancy,
+					 __atomic_load_n(&s->max_occupancy,
+							 __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * Enqueue/dequeue through the path selected by the queue handle @flags, and
+ * account the operation in @stats, if any
+ */
+static inline
+int rpcmsg_enqueue_flags(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			 unsigned int flags, rpcmsg_queue_stats_t *stats,
+			 rpcmsg_enqueue_elem_fn_t enqueue_fn,
+			 void const * const data)
+{
+	uint64_t retries = rpcmsg_cas_retries_get();
+	int err;
 
-	} while (!atomic_compare_and_swap(&q->cons.tail.raw, (uint64_t *)(uintptr_t)&ot.raw, nt.raw));
+	if ((flags & RPCMSG_QF_SP) && !rpcmsg_queue_is_seq(q))
+		err = rpcmsg_sp_enqueue_bulk(q, b, enqueue_fn, data, 0, 1);
+	else
+		err = rpcmsg_enqueue(q, b, enqueue_fn, data);
 
-	*entry = ot.marker.pos;
+	rpcmsg_stats_tx(stats, q, err ? 0 : 1,
+			rpcmsg_cas_retries_get() - retries);
 
-	return ret;
+	return err;
 }
 
 static inline
-void rpcmsg_commit_update(volatile rpcmsg_queue_bound_t *bound)
+int rpcmsg_dequeue_flags(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			 unsigned int flags, rpcmsg_queue_stats_t *stats,
+			 rpcmsg_dequeue_elem_fn_t dequeue_fn,
+			 void * const data)
 {
-	rpcmsg_marker_t t, oh, nh;
-
-	/*
-	 * If there are other enqueues/dequeues in progress that
-	 * might preceded us, then don't update marker position, just updater
-	 * count.
-	 */
-	oh.raw = atomic_load_acquire(&bound->head.raw);
+	uint64_t retries = rpcmsg_cas_retries_get();
+	int err;
 
-	do {
-		t.raw = atomic_load_acquire(&bound->tail.raw);
+	if ((flags & RPCMSG_QF_SC) && !rpcmsg_queue_is_seq(q))
+		err = rpcmsg_sc_dequeue_bulk(q, b, dequeue_fn, data, 0, 1) ? 0 : -1;
+	else
+		err = rpcmsg_dequeue(q, b, dequeue_fn, data);
 
-		nh.raw = oh.raw;
-		if (++nh.marker.count == t.marker.count)
-			nh.marker.pos = t.marker.pos;
+	rpcmsg_stats_rx(stats, err ? 0 : 1, rpcmsg_cas_retries_get() - retries);
 
-	} while (!atomic_compare_and_swap(&bound->head.raw, (uint64_t *)(uintptr_t)&oh.raw, nh.raw));
+	return err;
 }
 
 static inline
-int rpcmsg_enqueue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
-		   rpcmsg_enqueue_elem_fn_t enqueue_fn, void const * const data)
+int rpcmsg_enqueue_bulk_flags(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+			      unsigned int flags, rpcmsg_queue_stats_t *stats,
+			      rpcmsg_enqueue_elem_fn_t enqueue_fn,
+			      void const * const data, size_t stride,
+			      uint32_t n)
 {
-	uint32_t entry;
-
-	rpc_assert(q);
-	rpc_assert(b);
-	rpc_assert(enqueue_fn);
-	rpc_assert(data);
+	uint64_t retries = rpcmsg_cas_retries_get();
+	int err;
 
-	if (rpcmsg_acquire_prod_entry(q, &entry)) {
-		/* full */
-		return -1;
-	}
+	if ((flags & RPCMSG_QF_SP) && !rpcmsg_queue_is_seq(q))
+		err = rpcmsg_sp_enqueue_bulk(q, b, enqueue_fn, data, stride, n);
+	else
+		err = rpcmsg_enqueue_bulk(q, b, enqueue_fn, data, stride, n);
 
-	/* enqueue entry */
-	enqueue_fn(q, b, entry & RPCMSG_BUFFER_MASK, data);
-	rpcmsg_commit_update(&q->prod);
+	rpcmsg_stats_tx(stats, q, err ? 0 : n,
+			rpcmsg_cas_retries_get() - retries);
 
-	return 0;
+	return err;
 }
 
 static inline
-int rpcmsg_dequeue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
-		   rpcmsg_dequeue_elem_fn_t dequeue_fn, void * const data)
+uint32_t rpcmsg_dequeue_bulk_flags(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
+				   unsigned int flags,
+				   rpcmsg_queue_stats_t *stats,
+				   rpcmsg_dequeue_elem_fn_t dequeue_fn,
+				   void * const data, size_t stride,
+				   uint32_t n)
 {
-	uint32_t entry;
-
-	rpc_assert(q);
-	rpc_assert(b);
-	rpc_assert(dequeue_fn);
-	rpc_assert(data);
+	uint64_t retries = rpcmsg_cas_retries_get();
+	uint32_t count;
 
-	if (rpcmsg_acquire_cons_entry(q, &entry)) {
-		/* empty */
-		return -1;
-	}
+	if ((flags & RPCMSG_QF_SC) && !rpcmsg_queue_is_seq(q))
+		count = rpcmsg_sc_dequeue_bulk(q, b, dequeue_fn, data, stride, n);
+	else
+		count = rpcmsg_dequeue_bulk(q, b, dequeue_fn, data, stride, n);
 
-	/* dequeue entry */
-	dequeue_fn(q, b, entry & RPCMSG_BUFFER_MASK, data);
-	rpcmsg_commit_update(&q->cons);
+	rpcmsg_stats_rx(stats, count, rpcmsg_cas_retries_get() - retries);
 
-	return 0;
+	return count;
 }
 
 #define RPCMSG_F_INIT_BUFFER	1
@@ -357,6 +1459,9 @@ int rpcmsg_dequeue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
 	do {						\
 		(_ptr)->buffer = (_b);			\
 		(_ptr)->queue = (_q);			\
+		(_ptr)->flags = 0;			\
+		(_ptr)->stats = NULL;			\
+		(_ptr)->trace = NULL;			\
 		_rpcmsg_queue_init((_ptr), (_flags));	\
 	} while(0)
 
@@ -364,6 +1469,9 @@ int rpcmsg_dequeue(rpcmsg_queue_t *q, rpcmsg_buffer_t *b,
 typedef struct rpcmsg_event_queue {
 	rpcmsg_buffer_t *buffer;
 	rpcmsg_queue_t *queue;
+	unsigned int flags;	/* RPCMSG_QF_* */
+	rpcmsg_queue_stats_t *stats;
+	rpcmsg_trace_t *trace;
 } rpcmsg_event_queue_t;
 
 /* Event queue initializer helpers */
@@ -378,7 +1486,7 @@ typedef struct rpcmsg_event_queue {
 	_rpcmsg_queue_init((_ptr), 0)
 
 static inline
-void rpcmsg_event_enqueue_fn(rpcmsg_queue_t * const q,
+void rpcmsg_event_enqueue_fn(rpcmsg_queue_t * const q __maybe_unused,
 			     rpcmsg_buffer_t * const b,
 			     uint32_t ring_index,
 			     void const * const data)
@@ -390,11 +1498,10 @@ void rpcmsg_event_enqueue_fn(rpcmsg_queue_t * const q,
 	/* pointer to message buffer */
 	msg = rpcmsg_id_to_msg(b, ring_index);
 
-	/* copy data to message */
+	/* copy data to message, events are stored inline in the slot of
+	 * their ring entry and the ring itself is not used
+	 */
 	memcpy(msg, data, sizeof(*msg));
-
-	/* id to ring */
-	q->ring[ring_index] = rpcmsg_msg_to_id(b, msg);
 }
 
 static inline
@@ -411,11 +1518,23 @@ int rpcmsg_event_tx(rpcmsg_event_queue_t *eq,
 	msg.mr2 = mr2;
 	msg.mr3 = mr3;
 
-	return rpcmsg_enqueue(eq->queue, eq->buffer, rpcmsg_event_enqueue_fn, &msg);
+	return rpcmsg_enqueue_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+				    rpcmsg_event_enqueue_fn, &msg);
+}
+
+static inline
+int rpcmsg_event_tx_bulk(rpcmsg_event_queue_t *eq, rpcmsg_t const *msgs,
+			 uint32_t n)
+{
+	rpc_assert(eq);
+
+	return rpcmsg_enqueue_bulk_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+					 rpcmsg_event_enqueue_fn,
+					 msgs, sizeof(*msgs), n);
 }
 
 static inline
-void rpcmsg_event_dequeue_fn(rpcmsg_queue_t *q,
+void rpcmsg_event_dequeue_fn(rpcmsg_queue_t *q __maybe_unused,
 			     rpcmsg_buffer_t *b,
 			     uint32_t ring_index,
 			     void * const data)
@@ -424,8 +1543,8 @@ void rpcmsg_event_dequeue_fn(rpcmsg_queue_t *q,
 
 	rpc_assert(data);
 
-	/* pointer to received message */
-	msg = rpcmsg_id_to_msg(b, q->ring[ring_index]);
+	/* pointer to received message, inline in the slot */
+	msg = rpcmsg_id_to_msg(b, ring_index);
 
 	/* copy message to given pointer */
 	memcpy(data, msg, sizeof(*msg));
@@ -436,7 +1555,184 @@ int rpcmsg_event_rx(rpcmsg_event_queue_t *eq, rpcmsg_t *msg)
 {
 	rpc_assert(eq);
 
-	return rpcmsg_dequeue(eq->queue, eq->buffer, rpcmsg_event_dequeue_fn, msg);
+	return rpcmsg_dequeue_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+				    rpcmsg_event_dequeue_fn, msg);
+}
+
+static inline
+uint32_t rpcmsg_event_rx_bulk(rpcmsg_event_queue_t *eq, rpcmsg_t *msgs,
+			      uint32_t n)
+{
+	rpc_assert(eq);
+
+	return rpcmsg_dequeue_bulk_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+					 rpcmsg_event_dequeue_fn,
+					 msgs, sizeof(*msgs), n);
+}
+
+/*
+ * Events with a payload. The payload is copied to the payload slice of the
+ * event slot on send, and out of it on receive, like the message itself.
+ */
+typedef uint32_t rpcmsg_payload_len_fn_t(rpcmsg_t const *msg);
+
+typedef struct rpcmsg_event_payload {
+	rpcmsg_t *msg;
+	void *payload;
+	uint32_t len;
+	rpcmsg_payload_len_fn_t *len_fn;
+} rpcmsg_event_payload_t;
+
+static inline
+void rpcmsg_event_payload_enqueue_fn(rpcmsg_queue_t * const q,
+				     rpcmsg_buffer_t * const b,
+				     uint32_t ring_index,
+				     void const * const data)
+{
+	rpcmsg_event_payload_t const *ep = data;
+
+	rpc_assert(ep);
+
+	if (ep->len) {
+		memcpy(rpcmsg_payload(b, ring_index), ep->payload, ep->len);
+	}
+
+	rpcmsg_event_enqueue_fn(q, b, ring_index, ep->msg);
+}
+
+static inline
+void rpcmsg_event_payload_dequeue_fn(rpcmsg_queue_t *q,
+				     rpcmsg_buffer_t *b,
+				     uint32_t ring_index,
+				     void * const data)
+{
+	rpcmsg_event_payload_t *ep = data;
+
+	rpc_assert(ep);
+
+	rpcmsg_event_dequeue_fn(q, b, ring_index, ep->msg);
+
+	/* the sender is not trusted to stay within the slice */
+	ep->len = min(min(ep->len_fn(ep->msg), b->payload_size), ep->len);
+	if (ep->len) {
+		memcpy(ep->payload, rpcmsg_payload(b, ring_index), ep->len);
+	}
+}
+
+/* Send @msg with @len bytes of @payload */
+static inline
+int rpcmsg_event_tx_payload(rpcmsg_event_queue_t *eq, rpcmsg_t *msg,
+			    void const *payload, uint32_t len)
+{
+	rpcmsg_event_payload_t ep = {
+		.msg = msg,
+		.payload = (void *)payload,
+		.len = len,
+	};
+
+	rpc_assert(eq);
+	rpc_assert(msg);
+
+	if (len > eq->buffer->payload_size) {
+		return -1;
+	}
+
+	return rpcmsg_enqueue_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+				    rpcmsg_event_payload_enqueue_fn, &ep);
+}
+
+/*
+ * Receive an event to @msg and its payload to @payload of @len bytes.
+ * @len_fn tells the payload length of a received message. Returns the
+ * payload length, or -1 if the queue is empty.
+ */
+static inline
+int rpcmsg_event_rx_payload(rpcmsg_event_queue_t *eq, rpcmsg_t *msg,
+			    void *payload, uint32_t len,
+			    rpcmsg_payload_len_fn_t *len_fn)
+{
+	rpcmsg_event_payload_t ep = {
+		.msg = msg,
+		.payload = payload,
+		.len = payload ? len : 0,
+		.len_fn = len_fn,
+	};
+
+	rpc_assert(eq);
+	rpc_assert(msg);
+	rpc_assert(len_fn);
+
+	if (rpcmsg_dequeue_flags(eq->queue, eq->buffer, eq->flags, eq->stats,
+				 rpcmsg_event_payload_dequeue_fn, &ep)) {
+		return -1;
+	}
+
+	return (int) ep.len;
+}
+
+/*
+ * Zero-copy receive. Returns the next event in place in its slot, or NULL if
+ * the queue is empty. Its payload, if any, is at rpcmsg_msg_payload(). The
+ * slot is owned by the caller until rpcmsg_event_release(), producers
+ * cannot reuse it before that.
+ *
+ * A consumer thread peeks and releases one event at a time. With multiple
+ * consumers the events may be released in any order.
+ */
+static inline
+rpcmsg_t *rpcmsg_event_peek(rpcmsg_event_queue_t *eq)
+{
+	uint64_t retries = rpcmsg_cas_retries_get();
+	rpcmsg_queue_t *q;
+	uint32_t entry;
+	bool empty;
+
+	rpc_assert(eq);
+
+	q = eq->queue;
+
+	if ((eq->flags & RPCMSG_QF_SC) && !rpcmsg_queue_is_seq(q)) {
+		/* the consumer bound is ours, the tail moves on release */
+		entry = q->cons.tail.marker.pos;
+		empty = atomic_load_acquire(&q->prod.head.marker.pos) == entry;
+	} else {
+		empty = !!rpcmsg_acquire_cons_entry(q, &entry);
+	}
+
+	rpcmsg_stats_rx(eq->stats, empty ? 0 : 1,
+			rpcmsg_cas_retries_get() - retries);
+
+	if (empty) {
+		return NULL;
+	}
+
+	return rpcmsg_id_to_msg(eq->buffer, entry & q->mask);
+}
+
+/* Release @msg returned by rpcmsg_event_peek() */
+static inline
+void rpcmsg_event_release(rpcmsg_event_queue_t *eq, rpcmsg_t *msg)
+{
+	rpcmsg_queue_t *q;
+
+	rpc_assert(eq);
+	rpc_assert(msg);
+
+	q = eq->queue;
+
+	if (rpcmsg_queue_is_seq(q)) {
+		/* the slot is the ring entry, its sequence tells the lap */
+		volatile uint32_t *seq = rpcmsg_queue_seq(q);
+		uint16_t id = rpcmsg_msg_to_id(eq->buffer, msg);
+
+		atomic_store_release(&seq[id], seq[id] - 1 + q->size);
+	} else if (eq->flags & RPCMSG_QF_SC) {
+		rpcmsg_marker_t t = { .raw = q->cons.tail.raw };
+
+		rpcmsg_spsc_publish(&q->cons, t, 1);
+	} else {
+		rpcmsg_commit_update(&q->cons);
+	}
 }
 
 /* RPC queue is a mpmc queue that together with one or more reply queues
@@ -464,8 +1760,19 @@ int rpcmsg_event_rx(rpcmsg_event_queue_t *eq, rpcmsg_t *msg)
 typedef struct rpcmsg_rpc_queue {
 	rpcmsg_buffer_t *buffer;
 	rpcmsg_queue_t *queue;
+	unsigned int flags;	/* RPCMSG_QF_* */
+	rpcmsg_queue_stats_t *stats;
+	/* per message stamps, indexed by message id, NULL if off */
+	rpcmsg_trace_t *trace;
 } rpcmsg_rpc_queue_t;
 
+static inline
+void rpcmsg_trace_msg(rpcmsg_rpc_queue_t *rpc, rpcmsg_t *msg, rpcmsg_ts_t ts)
+{
+	if (rpc->trace)
+		rpcmsg_trace_stamp(rpc->trace, rpcmsg_msg_to_id(rpc->buffer, msg), ts);
+}
+
 /* RPC initializer helpers */
 #define rpcmsg_call_queue_init(_ptr) \
 	_rpcmsg_queue_init((_ptr), RPCMSG_F_INIT_ALL)
@@ -485,43 +1792,135 @@ typedef struct rpcmsg_rpc_queue {
 #define rpcmsg_reply_queue(_ptr, _b, _q) \
 	_rpcmsg_queue((_ptr), (_b), (_q), RPCMSG_F_INIT_QUEUE)
 
-typedef DECLARE_BITMAP(rpcmsg_buffer_state_t, RPCMSG_BUFFER_SIZE);
+/*
+ * Message ids available for lending, a lock-free stack private to the
+ * lending side. @head holds the top id and a tag that is bumped on every
+ * update, so that a CAS based on a stale head fails even if the same id is
+ * back on top (ABA). @next links the free ids.
+ */
+#define RPCMSG_FREE_NIL 0xffffU
+
+typedef union rpcmsg_free_head {
+	uint64_t raw  __attribute__ ((aligned (8)));
+	struct {
+		uint32_t id;
+		uint32_t tag;
+	} top;
+} rpcmsg_free_head_t;
 
-#define rpcmsg_buffer_state_init(_buf_state)		\
-	do {						\
-		memset((_buf_state), 0,			\
-		       sizeof(rpcmsg_buffer_state_t));	\
-	} while(0)
+typedef struct rpcmsg_buffer_state {
+	volatile uint64_t head;
+	volatile uint16_t next[RPCMSG_RING_SIZE_MAX];
+} rpcmsg_buffer_state_t;
+
+static_assert(RPCMSG_RING_SIZE_MAX < RPCMSG_FREE_NIL,
+	      "message ids must not collide with RPCMSG_FREE_NIL");
+
+/* Put all @size messages of a buffer to the free list */
+static inline
+void rpcmsg_buffer_state_init(rpcmsg_buffer_state_t *state, uint32_t size)
+{
+	rpcmsg_free_head_t h;
+	uint32_t id;
+
+	rpc_assert(state);
+	rpc_assert(size <= RPCMSG_RING_SIZE_MAX);
+
+	for (id = 0; id < size; id++) {
+		state->next[id] = (id + 1 < size) ? id + 1 : RPCMSG_FREE_NIL;
+	}
+
+	h.top.id = size ? 0 : RPCMSG_FREE_NIL;
+	h.top.tag = 0;
+	atomic_store_release(&state->head, h.raw);
+}
+
+/*
+ * Take @n ids off the free list with a single CAS, all or nothing. The ids
+ * are stored to @ids. Returns false if fewer than @n ids are free.
+ */
+static inline
+bool rpcmsg_free_pop(rpcmsg_buffer_state_t *state, uint16_t *ids, uint32_t n)
+{
+	rpcmsg_free_head_t oh, nh;
+	uint32_t id, i;
+
+	for (;;) {
+		oh.raw = atomic_load_acquire(&state->head);
+
+		/* walk the list; a stale walk is caught by the tag */
+		id = oh.top.id;
+		for (i = 0; i < n && id != RPCMSG_FREE_NIL; i++) {
+			ids[i] = id;
+			id = state->next[id];
+		}
+
+		if (i < n) {
+			if (atomic_load_relaxed(&state->head) == oh.raw) {
+				/* not enough free ids */
+				return false;
+			}
+			rpcmsg_cas_retry_hook();
+			continue;
+		}
+
+		nh.top.id = id;
+		nh.top.tag = oh.top.tag + 1;
+		/* the acquire load above ordered the walk and the message
+		 * accesses after the push that freed them
+		 */
+		if (rpcmsg_marker_cas(&state->head, (uint64_t *)(uintptr_t)&oh.raw,
+				      nh.raw, relaxed)) {
+			return true;
+		}
+	}
+}
+
+static inline
+void rpcmsg_free_push(rpcmsg_buffer_state_t *state, uint16_t id)
+{
+	rpcmsg_free_head_t oh, nh;
 
+	oh.raw = atomic_load_relaxed(&state->head);
 
+	do {
+		state->next[id] = oh.top.id;
+		nh.top.id = id;
+		nh.top.tag = oh.top.tag + 1;
+
+		/* publish next[id] and the message along with the head */
+	} while (!rpcmsg_marker_cas(&state->head, (uint64_t *)(uintptr_t)&oh.raw,
+				    nh.raw, release));
+}
+
+/* Lend a message buffer; NULL if all of them are in use */
 static inline
 rpcmsg_t *rpcmsg_lend_buffer(rpcmsg_rpc_queue_t *rpc,
-			     rpcmsg_buffer_state_t state)
+			     rpcmsg_buffer_state_t *state)
 {
 	uint16_t id;
 
 	rpc_assert(rpc);
+	rpc_assert(state);
 
-	id = find_first_zero_bit(state, RPCMSG_BUFFER_SIZE);
-	if (id >= RPCMSG_BUFFER_SIZE) {
+	if (!rpcmsg_free_pop(state, &id, 1)) {
 		/* all messages in use */
 		return NULL;
 	}
 
-	set_bit(id, state);
 	return rpcmsg_id_to_msg(rpc->buffer, id);
 }
 
 static inline
 void rpcmsg_reclaim_buffer(rpcmsg_rpc_queue_t *rpc,
-			   rpcmsg_buffer_state_t state,
+			   rpcmsg_buffer_state_t *state,
 			   rpcmsg_t *msg)
 {
 	rpc_assert(rpc);
 	rpc_assert(state);
 	rpc_assert(msg);
 
-	clear_bit(rpcmsg_msg_to_id(rpc->buffer, msg), state);
+	rpcmsg_free_push(state, rpcmsg_msg_to_id(rpc->buffer, msg));
 }
 
 static inline
@@ -538,9 +1937,23 @@ void rpcmsg_rpc_enqueue_fn(rpcmsg_queue_t *q,
 	q->ring[ring_index] = rpcmsg_msg_to_id(b, (rpcmsg_t *) data);
 }
 
+/* Same as rpcmsg_rpc_enqueue_fn(), but @data points to a message pointer */
+static inline
+void rpcmsg_rpc_enqueue_ptr_fn(rpcmsg_queue_t *q,
+			       rpcmsg_buffer_t *b,
+			       uint32_t ring_index,
+			       void const * const data)
+{
+	rpcmsg_t * const *msg = data;
+
+	rpc_assert(msg);
+
+	rpcmsg_rpc_enqueue_fn(q, b, ring_index, *msg);
+}
+
 static inline
 int rpcmsg_request(rpcmsg_rpc_queue_t *rpc,
-		   rpcmsg_buffer_state_t state,
+		   rpcmsg_buffer_state_t *state,
 		   seL4_Word mr0, seL4_Word mr1,
 		   seL4_Word mr2, seL4_Word mr3)
 {
@@ -551,13 +1964,66 @@ int rpcmsg_request(rpcmsg_rpc_queue_t *rpc,
 
 	/* find next available buffer for rpc */
 	msg = rpcmsg_lend_buffer(rpc, state);
+	if (!msg) {
+		/* all messages in flight, try again later */
+		return -1;
+	}
+
+	msg->mr0 = mr0;
+	msg->mr1 = mr1;
+	msg->mr2 = mr2;
+	msg->mr3 = mr3;
+
+	rpcmsg_trace_msg(rpc, msg, rpcmsg_ts_request);
+
+	if (rpcmsg_enqueue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				 rpcmsg_rpc_enqueue_fn, msg)) {
+		rpcmsg_reclaim_buffer(rpc, state, msg);
+		return -1;
+	}
+
+	return (int) rpcmsg_msg_to_id(rpc->buffer, msg);
+}
+
+/*
+ * Same as rpcmsg_request(), but also copies @len bytes of @payload to the
+ * payload slice of the lent message. The receiver reads it in place with
+ * rpcmsg_msg_payload() and may write a reply payload there.
+ */
+static inline
+int rpcmsg_request_payload(rpcmsg_rpc_queue_t *rpc,
+			   rpcmsg_buffer_state_t *state,
+			   seL4_Word mr0, seL4_Word mr1,
+			   seL4_Word mr2, seL4_Word mr3,
+			   void const *payload, uint32_t len)
+{
+	rpcmsg_t *msg;
+
+	rpc_assert(rpc);
+	rpc_assert(state);
+
+	if (len > rpc->buffer->payload_size) {
+		return -1;
+	}
+
+	msg = rpcmsg_lend_buffer(rpc, state);
+	if (!msg) {
+		return -1;
+	}
+
+	if (len) {
+		memcpy(rpcmsg_msg_payload(rpc->buffer, msg), payload, len);
+	}
 
 	msg->mr0 = mr0;
 	msg->mr1 = mr1;
 	msg->mr2 = mr2;
 	msg->mr3 = mr3;
 
-	if (rpcmsg_enqueue(rpc->queue, rpc->buffer, rpcmsg_rpc_enqueue_fn, msg)) {
+	rpcmsg_trace_msg(rpc, msg, rpcmsg_ts_request);
+
+	if (rpcmsg_enqueue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				 rpcmsg_rpc_enqueue_fn, msg)) {
 		rpcmsg_reclaim_buffer(rpc, state, msg);
 		return -1;
 	}
@@ -565,6 +2031,51 @@ int rpcmsg_request(rpcmsg_rpc_queue_t *rpc,
 	return (int) rpcmsg_msg_to_id(rpc->buffer, msg);
 }
 
+/*
+ * Send @n requests, whose contents are copied from @msgs, in one go. Either
+ * all requests are sent (returns 0) or none (returns -1).
+ */
+static inline
+int rpcmsg_request_bulk(rpcmsg_rpc_queue_t *rpc,
+			rpcmsg_buffer_state_t *state,
+			rpcmsg_t const *msgs, uint32_t n)
+{
+	rpcmsg_t *lent[RPCMSG_BULK_MAX];
+	uint16_t ids[RPCMSG_BULK_MAX];
+	uint32_t i;
+
+	rpc_assert(rpc);
+	rpc_assert(state);
+	rpc_assert(msgs);
+
+	if (n > RPCMSG_BULK_MAX) {
+		return -1;
+	}
+
+	/* all buffers with one CAS */
+	if (!rpcmsg_free_pop(state, ids, n)) {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		lent[i] = rpcmsg_id_to_msg(rpc->buffer, ids[i]);
+		memcpy(lent[i], &msgs[i], sizeof(*lent[i]));
+		rpcmsg_trace_stamp(rpc->trace, ids[i], rpcmsg_ts_request);
+	}
+
+	if (!rpcmsg_enqueue_bulk_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				       rpcmsg_rpc_enqueue_ptr_fn, lent,
+				       sizeof(lent[0]), n)) {
+		return 0;
+	}
+
+	while (i--) {
+		rpcmsg_free_push(state, ids[i]);
+	}
+
+	return -1;
+}
+
 static inline
 void rpcmsg_rpc_dequeue_fn(rpcmsg_queue_t *q,
 			   rpcmsg_buffer_t *b,
@@ -588,20 +2099,47 @@ rpcmsg_t *rpcmsg_receive(rpcmsg_rpc_queue_t *rpc)
 
 	rpc_assert(rpc);
 
-	if (!rpcmsg_dequeue(rpc->queue, rpc->buffer, rpcmsg_rpc_dequeue_fn, &msg)) {
+	if (!rpcmsg_dequeue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				  rpcmsg_rpc_dequeue_fn, &msg)) {
+		rpcmsg_trace_msg(rpc, msg, rpcmsg_ts_receive);
 		return msg;
 	}
 
 	return NULL;
 }
 
+/*
+ * Receive up to @n requests to @msgs. Returns the number of requests
+ * received.
+ */
+static inline
+uint32_t rpcmsg_receive_bulk(rpcmsg_rpc_queue_t *rpc, rpcmsg_t **msgs,
+			     uint32_t n)
+{
+	uint32_t count, i;
+
+	rpc_assert(rpc);
+
+	count = rpcmsg_dequeue_bulk_flags(rpc->queue, rpc->buffer, rpc->flags,
+					  rpc->stats, rpcmsg_rpc_dequeue_fn,
+					  msgs, sizeof(*msgs), n);
+
+	for (i = 0; rpc->trace && i < count; i++)
+		rpcmsg_trace_msg(rpc, msgs[i], rpcmsg_ts_receive);
+
+	return count;
+}
+
 static inline
 int rpcmsg_reply(rpcmsg_rpc_queue_t *rpc, rpcmsg_t *msg)
 {
 	rpc_assert(rpc);
 	rpc_assert(msg);
 
-	return rpcmsg_enqueue(rpc->queue, rpc->buffer, rpcmsg_rpc_enqueue_fn, msg);
+	rpcmsg_trace_msg(rpc, msg, rpcmsg_ts_reply);
+
+	return rpcmsg_enqueue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				 rpcmsg_rpc_enqueue_fn, msg);
 }
 
 static inline
@@ -612,7 +2150,8 @@ rpcmsg_t *rpcmsg_receive_response(rpcmsg_rpc_queue_t *rpc,
 
 	rpc_assert(rpc);
 
-	if (!rpcmsg_dequeue(rpc->queue, rpc->buffer, rpcmsg_rpc_dequeue_fn, &msg)) {
+	if (!rpcmsg_dequeue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				  rpcmsg_rpc_dequeue_fn, &msg)) {
 		if (transaction_id) {
 			*transaction_id = rpcmsg_msg_to_id(rpc->buffer, msg);
 		}
@@ -627,6 +2166,7 @@ int rpcmsg_forward(rpcmsg_rpc_queue_t *rpc, rpcmsg_t *msg)
 	rpc_assert(rpc);
 	rpc_assert(msg);
 
-	return rpcmsg_enqueue(rpc->queue, rpc->buffer, rpcmsg_rpc_enqueue_fn, msg);
+	return rpcmsg_enqueue_flags(rpc->queue, rpc->buffer, rpc->flags, rpc->stats,
+				 rpcmsg_rpc_enqueue_fn, msg);
 }
 
@@ -30,6 +30,17 @@ struct sel4_irqline {
 };
 
 #define SEL4_MMIO_REGION_FREE	(1U)
+/* guest writes to the region complete without waiting for the device */
+#define SEL4_MMIO_REGION_POSTED	(2U)
+/* guest writes to the region are queued to the coalesced MMIO ring */
+#define SEL4_MMIO_REGION_COALESCED	(4U)
+/* guest reads of the region are served from the register shadow */
+#define SEL4_MMIO_REGION_SHADOW		(8U)
+/* shadowed registers are cleared by reads, with SEL4_MMIO_REGION_SHADOW */
+#define SEL4_MMIO_REGION_READ_CLEAR	(16U)
+/* offset of a shadowed region in the register shadow */
+#define SEL4_MMIO_REGION_SHADOW_SHIFT	16
+#define SEL4_MMIO_REGION_SHADOW_MASK	(0xffffULL << SEL4_MMIO_REGION_SHADOW_SHIFT)
 
 struct sel4_mmio_region_config {
 	__u64	gpa;
@@ -37,5 +48,16 @@ struct sel4_mmio_region_config {
 	__u64	flags;
 };
 
+#define SEL4_KICK_FREE		(1U)
+/* kick only on writes of the given data */
+#define SEL4_KICK_DATAMATCH	(2U)
+
+struct sel4_kick_config {
+	__u64	gpa;
+	__u64	data;
+	__u32	kick;
+	__u32	flags;
+};
+
 #endif /* __SEL4_VIRT_TYPES_H */
 
@@ -25,9 +25,22 @@ typedef uint64_t __u64;
 
 #include <tii/guest.h>
 
+/* ioreq slots 0..SEL4_MMIO_MAX_VCPU-1 belong to the vCPUs, the rest form a
+ * pool shared by native threads and asynchronous requests. The slot is
+ * carried in the MMIO request, which limits the number of slots.
+ */
 #define SEL4_MMIO_MAX_VCPU              16
-#define SEL4_MMIO_NATIVE_BASE           SEL4_MMIO_MAX_VCPU
-#define SEL4_MMIO_MAX_NATIVE            16
+#define SEL4_MMIO_POOL_BASE             SEL4_MMIO_MAX_VCPU
+#define SEL4_MMIO_MAX_SLOTS             (1U << RPC_MR0_MMIO_SLOT_WIDTH)
+#define SEL4_MMIO_MAX_POOL              (SEL4_MMIO_MAX_SLOTS - SEL4_MMIO_POOL_BASE)
+
+static_assert(SEL4_MMIO_MAX_POOL <= RPCMSG_RING_SIZE_MAX,
+              "ioreq pool too large for the free list");
+
+#define SEL4_MMIO_MAX_REGIONS           16
+#define SEL4_MMIO_MAX_KICKS             RPCMSG_KICK_MAX
+
+#define RPC_NUM_OPS                     (1U << RPC_MR0_OP_WIDTH)
 
 typedef int (*ioack_fn_t)(seL4_Word data, void *cookie);
 
@@ -36,8 +49,66 @@ typedef struct ioack {
     void *cookie;
 } ioack_t;
 
+typedef struct ioreq ioreq_t;
+
+typedef void (*ioreq_done_fn_t)(ioreq_t *req);
+
+/* A set of asynchronous ioreqs waited for together, see ioreq_submit() */
+typedef struct ioreq_group {
+    sync_sem_t done;
+    volatile unsigned int pending;
+} ioreq_group_t;
+
+/* Asynchronous ioreq. @callback and @cookie are set by the caller, the rest
+ * by ioreq_submit().
+ */
+struct ioreq {
+    /* called from rpc_run() on completion, may be NULL */
+    ioreq_done_fn_t callback;
+    void *cookie;
+    struct io_proxy *io_proxy;
+    ioreq_group_t *group;
+    unsigned int slot;
+    volatile int done;
+    /* value to write, or the value read once done */
+    uint64_t value;
+};
+
+/* MMIO region configured by the backend, unused if size is zero. Changed by
+ * rpc_run() only, under the seqcount @seq, as fault threads read it without
+ * locks.
+ */
+typedef struct io_proxy_region {
+    uint32_t seq;
+    uint64_t addr;
+    uint64_t size;
+    /* SEL4_MMIO_REGION_POSTED, _COALESCED, _SHADOW and _READ_CLEAR */
+    unsigned int flags;
+    /* offset of the region in the register shadow */
+    uint32_t shadow;
+} io_proxy_region_t;
+
+/* Address whose writes kick the backend, unused if flags is zero */
+typedef struct io_proxy_kick {
+    uint64_t addr;
+    uint64_t data;
+    unsigned int kick;
+    volatile unsigned int flags;
+} io_proxy_kick_t;
+
+/* io_proxy_kick_t flags */
+#define IO_PROXY_KICK_USED              1
+#define IO_PROXY_KICK_DATAMATCH         2
+
 typedef struct io_proxy {
     sync_sem_t backend_started;
+    /* posted by rpc_run() for threads stalled on a full request queue */
+    sync_sem_t space_avail;
+    /* threads blocked on space_avail, and drains that may have freed space,
+     * private to the VMM unlike the space waiters in the iobuf
+     */
+    uint32_t space_blocked;
+    uint32_t space_gen;
     int ok_to_run;
     vso_rpc_t rpc;
     int (*run)(struct io_proxy *io_proxy);
@@ -46,10 +117,31 @@ typedef struct io_proxy {
     uintptr_t ctrl_base;
     size_t ctrl_size;
     uintptr_t (*iobuf_get)(struct io_proxy *io_proxy);
+    size_t (*iobuf_size_get)(struct io_proxy *io_proxy);
+    /* queue depth, request message pool size and payload slice size of the
+     * iobuf
+     */
+    unsigned int iobuf_ring_size;
+    unsigned int iobuf_pool_size;
+    unsigned int iobuf_payload_size;
+    /* number of pooled ioreq slots, 0 for SEL4_MMIO_MAX_POOL */
+    unsigned int ioreq_slots;
     vka_t *vka;
-    ioack_t ioacks[SEL4_MMIO_MAX_VCPU + SEL4_MMIO_MAX_NATIVE];
+    ioack_t *ioacks;
+    unsigned int num_ioacks;
+    /* free pooled ioreq slots, indexed from SEL4_MMIO_POOL_BASE */
+    rpcmsg_buffer_state_t ioreq_pool;
+    io_proxy_region_t regions[SEL4_MMIO_MAX_REGIONS];
+    io_proxy_kick_t kicks[SEL4_MMIO_MAX_KICKS];
+    /* request latency histograms, NULL unless the iobuf is traced */
+    vso_trace_t *trace;
+    /* messages dispatched per opcode, see rpc_register() */
+    uint64_t rpc_hits[RPC_NUM_OPS];
 } io_proxy_t;
 
+typedef int (*rpc_callback_fn_t)(io_proxy_t *io_proxy, unsigned int op,
+                                 rpcmsg_t *msg);
+
 static inline int io_proxy_run(io_proxy_t *io_proxy)
 {
     return io_proxy->run(io_proxy);
@@ -64,6 +156,37 @@ int ioreq_native(io_proxy_t *io_proxy, unsigned int addr_space,
                  unsigned int direction, uintptr_t offset, size_t len,
                  uint64_t *value);
 
+void ioreq_native_exit(void);
+
+int ioreq_post(io_proxy_t *io_proxy, unsigned int addr_space, uintptr_t addr,
+               size_t size, uint64_t value);
+
+int io_proxy_region_add(io_proxy_t *io_proxy, uint64_t addr, uint64_t size,
+                        unsigned int flags, uint32_t shadow);
+
+int io_proxy_region_del(io_proxy_t *io_proxy, uint64_t addr, uint64_t size);
+
+int io_proxy_region_find(io_proxy_t *io_proxy, uint64_t addr, size_t len,
+                         io_proxy_region_t *region);
+
+int io_proxy_kick_config(io_proxy_t *io_proxy, uint64_t addr, uint64_t data,
+                         unsigned int kick, unsigned int flags);
+
+int io_proxy_kick_find(io_proxy_t *io_proxy, uint64_t addr, uint64_t value);
+
+int ioreq_group_init(io_proxy_t *io_proxy, ioreq_group_t *group);
+
+int ioreq_submit(io_proxy_t *io_proxy, ioreq_group_t *group, ioreq_t *req,
+                 unsigned int addr_space, unsigned int direction,
+                 uintptr_t addr, size_t size, uint64_t value);
+
+static inline bool ioreq_poll(ioreq_t *req)
+{
+    return __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+}
+
+void ioreq_group_wait(ioreq_group_t *group);
+
 void io_proxy_wait_for_backend(io_proxy_t *io_proxy);
 
 void io_proxy_init(io_proxy_t *io_proxy);
@@ -72,4 +195,18 @@ int libsel4vm_io_proxy_init(vm_t *vm, io_proxy_t *io_proxy);
 
 int rpc_run(io_proxy_t *io_proxy);
 
+/* non-zero while the calling thread consumes responses and events */
+extern __thread unsigned int rpc_run_depth;
+
+int rpc_register(unsigned int op, rpc_callback_fn_t handler);
+
+int rpc_register_irqs(uint32_t irq_base, uint32_t num_irq,
+                      rpc_callback_fn_t handler);
+
+void rpc_dispatch_report(io_proxy_t *io_proxy);
+
+void io_proxy_trace_report(io_proxy_t *io_proxy);
+
+void io_proxy_space_wake(io_proxy_t *io_proxy);
+
 int handle_mmio(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg);
@@ -17,12 +17,27 @@
 /* Bridge consumes one slot */
 #define PCI_NUM_AVAIL_DEVICES   (PCI_NUM_SLOTS - 1)
 
+/* Config space cached by the VMM, the extended config space is not */
+#define PCI_CFG_CACHE_SIZE      (256)
+#define PCI_CFG_CACHE_DWORDS    (PCI_CFG_CACHE_SIZE / 4)
+
 typedef struct io_proxy io_proxy_t;
 
+struct pci_cfg_prefetch;
+
+typedef struct pci_cfg_cache {
+    /* value, valid bit and write generation of each config space dword */
+    volatile uint64_t entry[PCI_CFG_CACHE_DWORDS];
+    /* dwords served from the cache */
+    volatile uint64_t cacheable;
+    struct pci_cfg_prefetch *prefetch;
+} pci_cfg_cache_t;
+
 typedef struct pcidev {
     uint32_t devfn;
     uint32_t backend_devfn;
     io_proxy_t *io_proxy;
+    pci_cfg_cache_t cfg_cache;
 } pcidev_t;
 
 extern pcidev_t *pci_devs[PCI_NUM_AVAIL_DEVICES];
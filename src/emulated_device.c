@@ -81,18 +81,91 @@ static int emudev_mmio_config(io_proxy_t *io_proxy,
                               uint64_t size,
                               uint64_t flags)
 {
-    if (flags & ~(SEL4_MMIO_REGION_FREE)) {
+    int err;
+
+    if (flags & ~(SEL4_MMIO_REGION_FREE | SEL4_MMIO_REGION_POSTED |
+                  SEL4_MMIO_REGION_COALESCED | SEL4_MMIO_REGION_SHADOW |
+                  SEL4_MMIO_REGION_READ_CLEAR |
+                  SEL4_MMIO_REGION_SHADOW_MASK)) {
         ZF_LOGE("Unknown mmio region flags 0x%" PRIx64, flags);
         return -1;
     }
 
+    if (!size || addr + size < addr) {
+        ZF_LOGE("Invalid MMIO region 0x%" PRIx64 " size 0x%" PRIx64, addr,
+                size);
+        return -1;
+    }
+
+    /* handled by the VMM instead of plain requests */
+    unsigned int fast = flags & (SEL4_MMIO_REGION_POSTED |
+                                 SEL4_MMIO_REGION_COALESCED |
+                                 SEL4_MMIO_REGION_SHADOW |
+                                 SEL4_MMIO_REGION_READ_CLEAR);
+    uint32_t shadow = (flags & SEL4_MMIO_REGION_SHADOW_MASK) >>
+                      SEL4_MMIO_REGION_SHADOW_SHIFT;
+
+    if ((fast & SEL4_MMIO_REGION_READ_CLEAR) &&
+        !(fast & SEL4_MMIO_REGION_SHADOW)) {
+        ZF_LOGE("Read to clear MMIO region 0x%" PRIx64 " is not shadowed",
+                addr);
+        return -1;
+    }
+
+    if ((fast & SEL4_MMIO_REGION_SHADOW) &&
+        (size > RPCMSG_SHADOW_SIZE || shadow > RPCMSG_SHADOW_SIZE - size)) {
+        ZF_LOGE("MMIO region 0x%" PRIx64 " size 0x%" PRIx64 " does not fit "
+                "to the register shadow at 0x%x", addr, size, shadow);
+        return -1;
+    }
+
+    /* regions in the control plane are reserved by the io_proxy already,
+     * only how their accesses are handled can be configured
+     */
+    bool ctrl = addr >= io_proxy->ctrl_base && size <= io_proxy->ctrl_size &&
+                addr - io_proxy->ctrl_base <= io_proxy->ctrl_size - size;
+
+    if (ctrl && !fast) {
+        ZF_LOGE("MMIO region 0x%" PRIx64 " size 0x%" PRIx64 " overlaps the "
+                "control plane", addr, size);
+        return -1;
+    }
+
     if (flags & SEL4_MMIO_REGION_FREE) {
+        if (fast) {
+            err = io_proxy_region_del(io_proxy, addr, size);
+            if (err || ctrl) {
+                return err;
+            }
+        }
         return mmio_res_free(io_proxy, addr, size);
     }
 
-    return mmio_res_assign(emudev_handler.vm,
-                           emudev_handler.fault_handler,
-                           io_proxy, addr, size);
+    if (fast) {
+        err = io_proxy_region_add(io_proxy, addr, size, fast, shadow);
+        if (err || ctrl) {
+            return err;
+        }
+    }
+
+    err = mmio_res_assign(emudev_handler.vm,
+                          emudev_handler.fault_handler,
+                          io_proxy, addr, size);
+    if (err && fast) {
+        io_proxy_region_del(io_proxy, addr, size);
+    }
+
+    return err;
+}
+
+static int emudev_kick_config(io_proxy_t *io_proxy, uint64_t addr,
+                              uint64_t data, uint64_t mr3)
+{
+    unsigned int kick = BIT_FIELD_GET(mr3, RPC_MR3_KICK_ID);
+    unsigned int flags = BIT_FIELD_GET(mr3, RPC_MR3_KICK_FLAGS);
+
+    /* @addr must be in an MMIO region of the backend to fault at all */
+    return io_proxy_kick_config(io_proxy, addr, data, kick, flags);
 }
 
 int handle_emudev(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
@@ -103,6 +176,9 @@ int handle_emudev(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
     case QEMU_OP_MMIO_REGION_CONFIG:
         err = emudev_mmio_config(io_proxy, msg->mr1, msg->mr2, msg->mr3);
         break;
+    case QEMU_OP_KICK_CONFIG:
+        err = emudev_kick_config(io_proxy, msg->mr1, msg->mr2, msg->mr3);
+        break;
     case QEMU_OP_SET_IRQ:
         err = emudev_irq_set(io_proxy, msg->mr1, msg->mr2);
         break;
@@ -4,26 +4,32 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+
+#include <stdlib.h>
+
 #include <sync/sem.h>
 
 #include <tii/io_proxy.h>
 #include <tii/guest.h>
 
+RPCMSG_WAIT_DEFINE();
+
+/* State of a native thread issuing synchronous ioreqs */
 typedef struct ioreq_native {
-    int slot;
+    bool initialized;
     sync_sem_t handoff;
+    vka_t *vka;
     uint64_t value;
 } ioreq_native_t;
 
 static __thread ioreq_native_t ioreq_native_data;
 
-static int free_native_slot = SEL4_MMIO_NATIVE_BASE;
-
-static int ioreq_native_slot(io_proxy_t *io_proxy);
+static int ioreq_native_init(io_proxy_t *io_proxy);
 static int ioreq_native_wait(uint64_t *value);
 static int ioack_native_read(seL4_Word data, void *cookie);
 static int ioack_native_write(seL4_Word data, void *cookie);
 static int ioreq_finish(io_proxy_t *io_proxy, unsigned int slot, seL4_Word data);
+static void ioreq_slot_put(io_proxy_t *io_proxy, unsigned int slot);
 
 int ioreq_start(io_proxy_t *io_proxy, unsigned int slot, ioack_fn_t ioack_read,
                 ioack_fn_t ioack_write, void *cookie, uint32_t addr_space,
@@ -32,7 +38,7 @@ int ioreq_start(io_proxy_t *io_proxy, unsigned int slot, ioack_fn_t ioack_read,
 {
     assert(io_proxy && size >= 0 && size <= sizeof(val));
 
-    if (slot >= ARRAY_SIZE(io_proxy->ioacks)) {
+    if (slot >= io_proxy->num_ioacks) {
         return -1;
     }
 
@@ -43,32 +49,88 @@ int ioreq_start(io_proxy_t *io_proxy, unsigned int slot, ioack_fn_t ioack_read,
     ioack->callback = (direction == SEL4_IO_DIR_READ) ? ioack_read : ioack_write;
     ioack->cookie = cookie;
 
-    return driver_rpc_req_mmio_start(&io_proxy->rpc, direction, addr_space, slot,
-                                     offset, size, val);
+    int err = driver_rpc_req_mmio_start(&io_proxy->rpc, direction, addr_space,
+                                        slot, offset, size, val);
+    if (err) {
+        /* no message buffer or ring entry available, the slot is free for
+         * a retry
+         */
+        ioack->callback = NULL;
+    }
+
+    return err;
 }
 
 static int ioreq_finish(io_proxy_t *io_proxy, unsigned int slot, seL4_Word data)
 {
-    rpc_assert(slot <= ARRAY_SIZE(io_proxy->ioacks));
+    rpc_assert(slot < io_proxy->num_ioacks);
 
     ioack_t *ioack = &io_proxy->ioacks[slot];
+    ioack_fn_t callback = ioack->callback;
+    void *cookie = ioack->cookie;
 
-    rpc_assert(ioack->callback);
-
-    int err = ioack->callback(data, ioack->cookie);
+    rpc_assert(callback);
 
+    /* the slot is free once the callback runs, it may start a new ioreq,
+     * and a pooled slot may be taken and rewritten by another thread as
+     * soon as it is put
+     */
     ioack->callback = NULL;
+    if (slot >= SEL4_MMIO_POOL_BASE) {
+        ioreq_slot_put(io_proxy, slot);
+    }
 
-    return err;
+    return callback(data, cookie);
+}
+
+/*
+ * ioreq slot pool
+ *
+ * Native threads and asynchronous requests take an ioreq slot from the pool
+ * of the io_proxy for the duration of a request only, so the number of
+ * threads is not limited, only the number of requests in flight. The pool
+ * is the lock-free free list also used for the RPC message buffers. The
+ * slot of a request is returned to the pool by ioreq_finish().
+ */
+static int ioreq_slot_get(io_proxy_t *io_proxy)
+{
+    uint16_t id;
+
+    if (!rpcmsg_free_pop(&io_proxy->ioreq_pool, &id, 1)) {
+        return -1;
+    }
+
+    return SEL4_MMIO_POOL_BASE + id;
+}
+
+static void ioreq_slot_put(io_proxy_t *io_proxy, unsigned int slot)
+{
+    rpc_assert(slot >= SEL4_MMIO_POOL_BASE && slot < io_proxy->num_ioacks);
+
+    rpcmsg_free_push(&io_proxy->ioreq_pool, slot - SEL4_MMIO_POOL_BASE);
+}
+
+/* Wait for a free slot, all of them are taken by requests in flight */
+static int ioreq_slot_wait(io_proxy_t *io_proxy)
+{
+    uint32_t iter = 0;
+    int slot;
+
+    while ((slot = ioreq_slot_get(io_proxy)) < 0) {
+        rpcmsg_plat_yield(&io_proxy->ioreq_pool.head,
+                          io_proxy->ioreq_pool.head, iter++);
+    }
+
+    return slot;
 }
 
-static int ioreq_native_slot(io_proxy_t *io_proxy)
+static int ioreq_native_init(io_proxy_t *io_proxy)
 {
-    /* ioreq_native_data is in thread local storage, hence a unique ID
-     * is returned for each native thread calling this.
+    /* ioreq_native_data is in thread local storage, each native thread has
+     * a semaphore of its own
      */
-    if (ioreq_native_data.slot) {
-        return ioreq_native_data.slot;
+    if (ioreq_native_data.initialized) {
+        return 0;
     }
 
     int err = sync_sem_new(io_proxy->vka, &ioreq_native_data.handoff, 0);
@@ -77,15 +139,24 @@ static int ioreq_native_slot(io_proxy_t *io_proxy)
         return -1;
     }
 
-    if (free_native_slot >= ARRAY_SIZE(io_proxy->ioacks)) {
-        ZF_LOGE("too many native threads");
-        return -1;
-    }
+    ioreq_native_data.vka = io_proxy->vka;
+    ioreq_native_data.initialized = true;
+
+    return 0;
+}
 
-    /* TODO: atomic read + increment? */
-    ioreq_native_data.slot = free_native_slot++;
+/*
+ * Release the resources of the calling native thread. To be called by
+ * threads that have issued ioreq_native() before they exit.
+ */
+void ioreq_native_exit(void)
+{
+    if (!ioreq_native_data.initialized) {
+        return;
+    }
 
-    return ioreq_native_data.slot;
+    sync_sem_destroy(ioreq_native_data.vka, &ioreq_native_data.handoff);
+    ioreq_native_data.initialized = false;
 }
 
 static int ioack_native_read(seL4_Word data, void *cookie)
@@ -123,16 +194,19 @@ int ioreq_native(io_proxy_t *io_proxy, unsigned int addr_space,
                  unsigned int direction, uintptr_t addr, size_t size,
                  uint64_t *value)
 {
-    int slot = ioreq_native_slot(io_proxy);
-    if (slot < 0) {
-        ZF_LOGE("ioreq_native_slot() failed");
+    int err = ioreq_native_init(io_proxy);
+    if (err) {
+        ZF_LOGE("ioreq_native_init() failed");
         return -1;
     }
 
-    int err = ioreq_start(io_proxy, slot, ioack_native_read,
-                          ioack_native_write, &ioreq_native_data, addr_space,
-                          direction, addr, size, *value);
+    int slot = ioreq_slot_wait(io_proxy);
+
+    err = ioreq_start(io_proxy, slot, ioack_native_read,
+                      ioack_native_write, &ioreq_native_data, addr_space,
+                      direction, addr, size, *value);
     if (err < 0) {
+        ioreq_slot_put(io_proxy, slot);
         ZF_LOGE("ioreq_start() failed (%d)", err);
         return -1;
     }
@@ -146,6 +220,318 @@ int ioreq_native(io_proxy_t *io_proxy, unsigned int addr_space,
     return 0;
 }
 
+static int ioack_async(seL4_Word data, void *cookie)
+{
+    ioreq_t *req = cookie;
+    ioreq_group_t *group = req->group;
+
+    req->value = data;
+    if (req->callback) {
+        req->callback(req);
+    }
+
+    /* the submitter may reuse @req from here on */
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+
+    if (group) {
+        sync_sem_post(&group->done);
+    }
+
+    return 0;
+}
+
+static int ioack_posted(seL4_Word data, void *cookie)
+{
+    return 0;
+}
+
+/*
+ * Send an MMIO write without waiting for the reply, which carries no data
+ * anyway. The backend processes the requests of the queue in order, so the
+ * write is seen before any later request of the caller.
+ * Returns -1 if no ioreq slot is free or the request could not be sent.
+ */
+int ioreq_post(io_proxy_t *io_proxy, unsigned int addr_space, uintptr_t addr,
+               size_t size, uint64_t value)
+{
+    int slot = ioreq_slot_get(io_proxy);
+    if (slot < 0) {
+        return -1;
+    }
+
+    int err = ioreq_start(io_proxy, slot, ioack_posted, ioack_posted, NULL,
+                          addr_space, SEL4_IO_DIR_WRITE, addr, size, value);
+    if (err) {
+        ioreq_slot_put(io_proxy, slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Rewrite @region under its seqcount, readers retry meanwhile */
+static void io_proxy_region_set(io_proxy_region_t *region, uint64_t addr,
+                                uint64_t size, unsigned int flags,
+                                uint32_t shadow)
+{
+    uint32_t seq = region->seq;
+
+    __atomic_store_n(&region->seq, seq + 1, __ATOMIC_RELAXED);
+    /* order the odd count before the field stores */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&region->addr, addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&region->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&region->flags, flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&region->shadow, shadow, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&region->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Configure [@addr, @addr + @size) as a region whose writes are posted or
+ * coalesced, or whose reads are served from the register shadow at @shadow,
+ * according to the SEL4_MMIO_REGION_* @flags. Regions must not overlap.
+ */
+int io_proxy_region_add(io_proxy_t *io_proxy, uint64_t addr, uint64_t size,
+                        unsigned int flags, uint32_t shadow)
+{
+    io_proxy_region_t *free_region = NULL;
+
+    if (!size || addr + size < addr) {
+        ZF_LOGE("Invalid MMIO region 0x%" PRIx64 " size 0x%" PRIx64, addr,
+                size);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < SEL4_MMIO_MAX_REGIONS; i++) {
+        io_proxy_region_t *region = &io_proxy->regions[i];
+
+        if (!region->size) {
+            free_region = free_region ? free_region : region;
+            continue;
+        }
+
+        if (addr < region->addr + region->size &&
+            region->addr < addr + size) {
+            ZF_LOGE("MMIO region 0x%" PRIx64 " size 0x%" PRIx64 " overlaps "
+                    "0x%" PRIx64 " size 0x%" PRIx64, addr, size,
+                    region->addr, region->size);
+            return -1;
+        }
+    }
+
+    if (!free_region) {
+        ZF_LOGE("Too many configured MMIO regions");
+        return -1;
+    }
+
+    io_proxy_region_set(free_region, addr, size, flags, shadow);
+
+    return 0;
+}
+
+int io_proxy_region_del(io_proxy_t *io_proxy, uint64_t addr, uint64_t size)
+{
+    for (unsigned int i = 0; i < SEL4_MMIO_MAX_REGIONS; i++) {
+        io_proxy_region_t *region = &io_proxy->regions[i];
+
+        if (region->size && region->size == size && region->addr == addr) {
+            io_proxy_region_set(region, 0, 0, 0, 0);
+            return 0;
+        }
+    }
+
+    ZF_LOGE("No configured MMIO region 0x%" PRIx64 " size 0x%" PRIx64, addr,
+            size);
+
+    return -1;
+}
+
+/*
+ * Copy the configured region containing the access to @region. Returns -1
+ * if there is none. The copy is consistent even if the region is changed
+ * meanwhile.
+ */
+int io_proxy_region_find(io_proxy_t *io_proxy, uint64_t addr, size_t len,
+                         io_proxy_region_t *region)
+{
+    for (unsigned int i = 0; i < SEL4_MMIO_MAX_REGIONS; i++) {
+        io_proxy_region_t *r = &io_proxy->regions[i];
+        uint32_t seq;
+
+        do {
+            while ((seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE)) & 1) {
+                rpcmsg_cpu_relax();
+            }
+
+            region->addr = __atomic_load_n(&r->addr, __ATOMIC_RELAXED);
+            region->size = __atomic_load_n(&r->size, __ATOMIC_RELAXED);
+            region->flags = __atomic_load_n(&r->flags, __ATOMIC_RELAXED);
+            region->shadow = __atomic_load_n(&r->shadow, __ATOMIC_RELAXED);
+
+            /* order the field loads before the count check */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq);
+
+        region->seq = seq;
+
+        if (region->size && addr >= region->addr &&
+            addr + len <= region->addr + region->size) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Register or, with SEL4_KICK_FREE in @flags, unregister @addr as a doorbell
+ * kick address of the backend. With SEL4_KICK_DATAMATCH only writes of
+ * @data kick.
+ */
+int io_proxy_kick_config(io_proxy_t *io_proxy, uint64_t addr, uint64_t data,
+                         unsigned int kick, unsigned int flags)
+{
+    unsigned int match = IO_PROXY_KICK_USED;
+
+    if (flags & ~(SEL4_KICK_FREE | SEL4_KICK_DATAMATCH)) {
+        ZF_LOGE("Unknown kick flags 0x%x", flags);
+        return -1;
+    }
+
+    if (kick >= RPCMSG_KICK_MAX) {
+        ZF_LOGE("Kick %u out of range", kick);
+        return -1;
+    }
+
+    if (flags & SEL4_KICK_DATAMATCH) {
+        match |= IO_PROXY_KICK_DATAMATCH;
+    }
+
+    for (unsigned int i = 0; i < SEL4_MMIO_MAX_KICKS; i++) {
+        io_proxy_kick_t *k = &io_proxy->kicks[i];
+
+        if (flags & SEL4_KICK_FREE) {
+            if (k->flags == match && k->addr == addr && k->kick == kick &&
+                (!(match & IO_PROXY_KICK_DATAMATCH) || k->data == data)) {
+                __atomic_store_n(&k->flags, 0, __ATOMIC_RELAXED);
+                return 0;
+            }
+            continue;
+        }
+
+        if (k->flags) {
+            continue;
+        }
+
+        k->addr = addr;
+        k->data = data;
+        k->kick = kick;
+        /* published by the flags, kicks are looked up without locks */
+        __atomic_store_n(&k->flags, match, __ATOMIC_RELEASE);
+
+        return 0;
+    }
+
+    ZF_LOGE("%s kick %u at 0x%" PRIx64 " failed",
+            (flags & SEL4_KICK_FREE) ? "Unregistering" : "Registering",
+            kick, addr);
+
+    return -1;
+}
+
+/* Kick of a write of @value to @addr, -1 if the write is no kick */
+int io_proxy_kick_find(io_proxy_t *io_proxy, uint64_t addr, uint64_t value)
+{
+    for (unsigned int i = 0; i < SEL4_MMIO_MAX_KICKS; i++) {
+        io_proxy_kick_t *k = &io_proxy->kicks[i];
+        unsigned int flags = __atomic_load_n(&k->flags, __ATOMIC_ACQUIRE);
+
+        if (!flags || k->addr != addr) {
+            continue;
+        }
+
+        if ((flags & IO_PROXY_KICK_DATAMATCH) && k->data != value) {
+            continue;
+        }
+
+        return k->kick;
+    }
+
+    return -1;
+}
+
+int ioreq_group_init(io_proxy_t *io_proxy, ioreq_group_t *group)
+{
+    group->pending = 0;
+
+    int err = sync_sem_new(io_proxy->vka, &group->done, 0);
+    if (err) {
+        ZF_LOGE("sync_sem_new() failed (%d)", err);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Start an MMIO or PCI config space request without waiting for it. Once
+ * the reply has been processed by rpc_run(), @req->value holds the value
+ * read, ioreq_poll() returns true and @req->callback, if any, is called.
+ * Any number of requests may be in flight in @group, up to the number of
+ * free ioreq slots; ioreq_group_wait() waits for all of them. @group may
+ * be NULL for requests nobody waits for.
+ * Returns -1 if no slot is free or the request could not be sent, @req is
+ * not in flight then.
+ */
+int ioreq_submit(io_proxy_t *io_proxy, ioreq_group_t *group, ioreq_t *req,
+                 unsigned int addr_space, unsigned int direction,
+                 uintptr_t addr, size_t size, uint64_t value)
+{
+    int slot = ioreq_slot_get(io_proxy);
+    if (slot < 0) {
+        return -1;
+    }
+
+    req->io_proxy = io_proxy;
+    req->group = group;
+    req->slot = slot;
+    req->done = 0;
+    req->value = value;
+
+    /* counted before it can complete; a completion callback may submit
+     * to the group too
+     */
+    if (group) {
+        __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+    }
+
+    int err = ioreq_start(io_proxy, slot, ioack_async, ioack_async, req,
+                          addr_space, direction, addr, size, value);
+    if (err) {
+        if (group) {
+            __atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+        }
+        ioreq_slot_put(io_proxy, slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait until every request submitted to @group has completed. Each
+ * completion posts the semaphore once.
+ */
+void ioreq_group_wait(ioreq_group_t *group)
+{
+    while (__atomic_load_n(&group->pending, __ATOMIC_RELAXED)) {
+        sync_sem_wait(&group->done);
+        __atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
 void io_proxy_wait_for_backend(io_proxy_t *io_proxy)
 {
     volatile int *ok_to_run = &io_proxy->ok_to_run;
@@ -154,22 +540,204 @@ void io_proxy_wait_for_backend(io_proxy_t *io_proxy)
     };
 }
 
+/* space_gen when the calling thread last retried a stalled send */
+static __thread uint32_t io_proxy_space_gen_seen;
+
+static void io_proxy_space_block(void *cookie)
+{
+    io_proxy_t *io_proxy = cookie;
+
+    __atomic_add_fetch(&io_proxy->space_blocked, 1, __ATOMIC_SEQ_CST);
+
+    /* a drain since the last retry may have freed space without seeing us,
+     * pairs with io_proxy_space_wake()
+     */
+    if (__atomic_load_n(&io_proxy->space_gen, __ATOMIC_SEQ_CST) ==
+        io_proxy_space_gen_seen) {
+        sync_sem_wait(&io_proxy->space_avail);
+    }
+
+    __atomic_sub_fetch(&io_proxy->space_blocked, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called while a request stalls on a full request queue or an exhausted
+ * message pool. Responses and events are consumed by the rpc_run() thread
+ * only, which frees the messages and rings the doorbell of the device, so
+ * this just waits according to rpcmsg_wait_policy before the send is
+ * retried. In the block stage the thread sleeps until rpc_run() has
+ * drained the queues, see io_proxy_space_wake().
+ */
+static int io_proxy_space_wait(void *cookie, uint32_t iter)
+{
+    io_proxy_t *io_proxy = cookie;
+    rpcmsg_queue_t *q = io_proxy->rpc.driver_rpc.request.queue;
+
+    /* the rpc_run() thread would wait for space only it can free, fail the
+     * send as without flow control
+     */
+    if (rpc_run_depth) {
+        return -1;
+    }
+
+    /* native accesses stall on the low priority lane */
+    if (!rpcmsg_queue_full(q)) {
+        q = io_proxy->rpc.driver_rpc.request_lo.queue;
+    }
+
+    volatile uint64_t *marker = rpcmsg_queue_space_marker(q);
+    rpcmsg_plat_wait(marker, *marker, iter, io_proxy_space_block, io_proxy);
+
+    /* the send is retried next */
+    io_proxy_space_gen_seen = __atomic_load_n(&io_proxy->space_gen,
+                                              __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+/* Wake up the threads stalled in io_proxy_space_wait(), from rpc_run() */
+void io_proxy_space_wake(io_proxy_t *io_proxy)
+{
+    /* order the dequeues before the count load, pairs with
+     * io_proxy_space_block()
+     */
+    __atomic_add_fetch(&io_proxy->space_gen, 1, __ATOMIC_SEQ_CST);
+
+    /* at most one post per blocked thread, extra posts of threads that did
+     * not block after all only make a later wait return early
+     */
+    uint32_t n = __atomic_load_n(&io_proxy->space_blocked, __ATOMIC_SEQ_CST);
+    for (; n; n--) {
+        sync_sem_post(&io_proxy->space_avail);
+    }
+}
+
 void io_proxy_init(io_proxy_t *io_proxy)
 {
     int err;
 
     uintptr_t iobuf_addr = io_proxy->iobuf_get(io_proxy);
+    size_t iobuf_size = io_proxy->iobuf_size_get(io_proxy);
+
+    unsigned int flags = 0;
+
+#ifdef RPCMSG_IOBUF_STATS
+    flags |= RPCMSG_IOBUF_F_STATS;
+#endif
+#ifdef RPCMSG_IOBUF_TRACE
+    flags |= RPCMSG_IOBUF_F_TRACE;
+#endif
+#ifdef RPCMSG_IOBUF_SEQ
+    flags |= RPCMSG_IOBUF_F_SEQ;
+#endif
+    /* unused unless the backend configures coalesced or shadowed regions */
+    flags |= RPCMSG_IOBUF_F_COALESCED | RPCMSG_IOBUF_F_SHADOW;
+
+    err = rpcmsg_iobuf_layout((void *) iobuf_addr, iobuf_size,
+                              io_proxy->iobuf_ring_size,
+                              io_proxy->iobuf_pool_size,
+                              io_proxy->iobuf_payload_size, flags);
+    if (err && flags) {
+        ZF_LOGW("iobuf too small for optional features (0x%x), disabled", flags);
+        flags = 0;
+        err = rpcmsg_iobuf_layout((void *) iobuf_addr, iobuf_size,
+                                  io_proxy->iobuf_ring_size,
+                                  io_proxy->iobuf_pool_size,
+                                  io_proxy->iobuf_payload_size, flags);
+    }
+    if (err) {
+        ZF_LOGF("rpcmsg_iobuf_layout() failed: ring %u pool %u payload %u "
+                "iobuf %zu bytes", io_proxy->iobuf_ring_size,
+                io_proxy->iobuf_pool_size, io_proxy->iobuf_payload_size,
+                iobuf_size);
+        /* no return */
+    }
+
+    /* responses and events are consumed by rpc_run() only */
+    unsigned int spsc = VSO_QUEUE_SC(queue_id_drvrpc_resp) |
+                        VSO_QUEUE_SC(queue_id_devevt) |
+                        VSO_QUEUE_SC(queue_id_devevt_lo);
 
-    err = vso_driver_rpc_init(vso_rpc_driver, (void *) iobuf_addr, &io_proxy->rpc.driver_rpc);
+    err = vso_driver_rpc_init_spsc(vso_rpc_driver, (void *) iobuf_addr,
+                                   &io_proxy->rpc.driver_rpc, spsc);
     if (err) {
-        ZF_LOGF("vso_driver_rpc_init() failed (%d)", err);
+        ZF_LOGF("vso_driver_rpc_init_spsc() failed (%d)", err);
         /* no return */
     }
     io_proxy->rpc.device_event = devevt_queue(iobuf_addr);
+    io_proxy->rpc.device_event.flags = vso_queue_flags(spsc, queue_id_devevt);
+    io_proxy->rpc.device_event_lo = devevt_queue_lo(iobuf_addr);
+    io_proxy->rpc.device_event_lo.flags = vso_queue_flags(spsc, queue_id_devevt_lo);
+    vso_rpc_doorbell_init(&io_proxy->rpc, vso_rpc_driver, (void *) iobuf_addr);
+
+    /* stall vCPUs on a full request queue instead of failing the fault */
+    io_proxy->rpc.space_wait = io_proxy_space_wait;
+    io_proxy->rpc.space_wait_cookie = io_proxy;
+
+    if (flags & RPCMSG_IOBUF_F_TRACE) {
+        io_proxy->trace = calloc(1, sizeof(*io_proxy->trace));
+        if (!io_proxy->trace) {
+            ZF_LOGW("Unable to allocate trace histograms, tracing disabled");
+        }
+    }
+
+    unsigned int ioreq_slots = io_proxy->ioreq_slots;
+    if (!ioreq_slots || ioreq_slots > SEL4_MMIO_MAX_POOL) {
+        if (ioreq_slots) {
+            ZF_LOGW("%u ioreq slots requested, limited to %u", ioreq_slots,
+                    SEL4_MMIO_MAX_POOL);
+        }
+        ioreq_slots = SEL4_MMIO_MAX_POOL;
+    }
+
+    io_proxy->num_ioacks = SEL4_MMIO_POOL_BASE + ioreq_slots;
+    io_proxy->ioacks = calloc(io_proxy->num_ioacks, sizeof(*io_proxy->ioacks));
+    if (!io_proxy->ioacks) {
+        ZF_LOGF("Unable to allocate ioreq slots");
+        /* no return */
+    }
+    rpcmsg_buffer_state_init(&io_proxy->ioreq_pool, ioreq_slots);
 
     if (sync_sem_new(io_proxy->vka, &io_proxy->backend_started, 0)) {
         ZF_LOGF("Unable to allocate semaphore");
     }
+
+    if (sync_sem_new(io_proxy->vka, &io_proxy->space_avail, 0)) {
+        ZF_LOGF("Unable to allocate semaphore");
+    }
+}
+
+void io_proxy_trace_report(io_proxy_t *io_proxy)
+{
+    static const char *lat_names[vso_lat_last] = {
+        [vso_lat_queue] = "queue",
+        [vso_lat_service] = "service",
+        [vso_lat_return] = "return",
+    };
+    vso_trace_t *trace = io_proxy->trace;
+
+    if (!trace) {
+        return;
+    }
+
+    for (unsigned int op = 0; op < VSO_TRACE_OPS; op++) {
+        for (unsigned int lat = 0; lat < vso_lat_last; lat++) {
+            rpcmsg_hist_t *h = &trace->hist[op][lat];
+
+            if (!h->count) {
+                continue;
+            }
+            ZF_LOGI("rpc op %u %s: n %llu p50 %llu p99 %llu max %llu ns", op,
+                    lat_names[lat], (unsigned long long) h->count,
+                    (unsigned long long) rpcmsg_ticks_to_ns(rpcmsg_hist_quantile(h, 500)),
+                    (unsigned long long) rpcmsg_ticks_to_ns(rpcmsg_hist_quantile(h, 990)),
+                    (unsigned long long) rpcmsg_ticks_to_ns(h->max));
+        }
+    }
+    if (trace->invalid) {
+        ZF_LOGI("rpc trace: %llu requests with out of order stamps",
+                (unsigned long long) trace->invalid);
+    }
 }
 
 int handle_mmio(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
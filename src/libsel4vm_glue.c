@@ -33,9 +33,6 @@
 
 #define INTERRUPT_PCI_INTX_BASE (VIRTIO_CON_PLAT_INTERRUPT_LINE)
 
-typedef int (*rpc_callback_fn_t)(io_proxy_t *io_proxy, unsigned int op,
-                                 rpcmsg_t *msg);
-
 extern vka_t _vka;
 
 /************************** PCI externs begin here **************************/
@@ -105,6 +102,221 @@ static inline uint64_t pci_cfg_start(pcidev_t *pcidev, unsigned int dir,
 #define pci_cfg_write(_pcidev, _offset, _sz, _val) \
     pci_cfg_start(_pcidev, SEL4_IO_DIR_WRITE, _offset, _sz, _val)
 
+/* PCI config space cache
+ *
+ * Guests enumerate devices and walk their capability lists with one config
+ * space access at a time, each one a round-trip to the backend. Registers
+ * that only change on guest writes are therefore served from a cache of
+ * dwords: the IDs, revision and class, header type, subsystem IDs, the
+ * capabilities pointer and the capability headers. Command and status,
+ * BARs and everything else always go to the backend.
+ *
+ * The cached dwords are prefetched with asynchronous reads when the device
+ * is registered, capability headers as the list is discovered. Each entry
+ * holds the value, a valid bit and a generation bumped by writes, so that
+ * a read racing with a write never fills the cache.
+ */
+#define PCI_CFG_ENTRY_VALUE     0xffffffffULL
+#define PCI_CFG_ENTRY_VALID     (1ULL << 32)
+#define PCI_CFG_ENTRY_GEN       (1ULL << 33)
+
+#define PCI_CFG_DWORD(_offset)  (1ULL << ((_offset) >> 2))
+
+#define PCI_CFG_CACHEABLE_HEADER                \
+    (PCI_CFG_DWORD(PCI_VENDOR_ID) |             \
+     PCI_CFG_DWORD(PCI_CLASS_REVISION) |        \
+     PCI_CFG_DWORD(PCI_CACHE_LINE_SIZE) |       \
+     PCI_CFG_DWORD(PCI_SUBSYSTEM_VENDOR_ID) |   \
+     PCI_CFG_DWORD(PCI_CAPABILITY_LIST))
+
+/* capabilities are located after the standard header */
+#define PCI_CFG_CAP_BASE        0x40
+
+typedef struct pci_cfg_prefetch {
+    ioreq_t req;
+    pcidev_t *pcidev;
+    unsigned int index;
+    uint64_t entry;
+} pci_cfg_prefetch_t;
+
+static void pci_cfg_cache_add(pcidev_t *pcidev, unsigned int index);
+
+static int pci_cfg_fetch(pcidev_t *pcidev, unsigned int index, uint32_t *value)
+{
+    unsigned int backend_slot = PCI_SLOT(pcidev->backend_devfn);
+    uint64_t data = 0;
+
+    int err = ioreq_native(pcidev->io_proxy, AS_PCIDEV(backend_slot),
+                           SEL4_IO_DIR_READ, index << 2, 4, &data);
+    if (err) {
+        ZF_LOGE("ioreq_native() failed (%d)", err);
+        return -1;
+    }
+
+    *value = data;
+
+    return 0;
+}
+
+/* Cache @value read for dword @index, unless the dword has been written or
+ * filled since @entry was loaded
+ */
+static void pci_cfg_cache_fill(pcidev_t *pcidev, unsigned int index,
+                               uint64_t entry, uint32_t value)
+{
+    pci_cfg_cache_t *cache = &pcidev->cfg_cache;
+    uint64_t filled = (entry & ~(PCI_CFG_ENTRY_VALID | PCI_CFG_ENTRY_VALUE)) |
+                      PCI_CFG_ENTRY_VALID | value;
+
+    if (entry & PCI_CFG_ENTRY_VALID) {
+        return;
+    }
+
+    if (!__atomic_compare_exchange_n(&cache->entry[index], &entry, filled,
+                                     false, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* follow the capability list */
+    unsigned int next = 0;
+    if (index == PCI_CAPABILITY_LIST >> 2) {
+        next = value & 0xfc;
+    } else if (index >= PCI_CFG_CAP_BASE >> 2) {
+        next = (value >> 8) & 0xfc;
+    }
+
+    if (next >= PCI_CFG_CAP_BASE) {
+        pci_cfg_cache_add(pcidev, next >> 2);
+    }
+}
+
+static void pci_cfg_cache_invalidate(pcidev_t *pcidev, unsigned int index)
+{
+    volatile uint64_t *entry = &pcidev->cfg_cache.entry[index];
+    uint64_t old = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do {
+        new = (old & ~(PCI_CFG_ENTRY_VALID | PCI_CFG_ENTRY_VALUE)) +
+              PCI_CFG_ENTRY_GEN;
+    } while (!__atomic_compare_exchange_n(entry, &old, new, false,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+}
+
+static void pci_cfg_prefetch_done(ioreq_t *req)
+{
+    pci_cfg_prefetch_t *prefetch = req->cookie;
+
+    pci_cfg_cache_fill(prefetch->pcidev, prefetch->index, prefetch->entry,
+                       req->value);
+}
+
+static void pci_cfg_prefetch(pcidev_t *pcidev, unsigned int index)
+{
+    pci_cfg_cache_t *cache = &pcidev->cfg_cache;
+
+    if (!cache->prefetch) {
+        return;
+    }
+
+    pci_cfg_prefetch_t *prefetch = &cache->prefetch[index];
+    unsigned int backend_slot = PCI_SLOT(pcidev->backend_devfn);
+
+    prefetch->pcidev = pcidev;
+    prefetch->index = index;
+    prefetch->entry = __atomic_load_n(&cache->entry[index], __ATOMIC_RELAXED);
+    prefetch->req.callback = pci_cfg_prefetch_done;
+    prefetch->req.cookie = prefetch;
+
+    int err = ioreq_submit(pcidev->io_proxy, NULL, &prefetch->req,
+                           AS_PCIDEV(backend_slot), SEL4_IO_DIR_READ,
+                           index << 2, 4, 0);
+    if (err) {
+        /* no free ioreq slot, filled by the first read instead */
+        ZF_LOGD("Config space prefetch of 0x%x deferred", index << 2);
+    }
+}
+
+/* Serve dword @index from the cache from now on */
+static void pci_cfg_cache_add(pcidev_t *pcidev, unsigned int index)
+{
+    uint64_t bit = 1ULL << index;
+
+    /* each dword is prefetched once, which also ends capability loops */
+    if (__atomic_fetch_or(&pcidev->cfg_cache.cacheable, bit,
+                          __ATOMIC_RELAXED) & bit) {
+        return;
+    }
+
+    pci_cfg_prefetch(pcidev, index);
+}
+
+static int pci_cfg_cache_init(pcidev_t *pcidev)
+{
+    pci_cfg_cache_t *cache = &pcidev->cfg_cache;
+
+    cache->prefetch = calloc(PCI_CFG_CACHE_DWORDS, sizeof(*cache->prefetch));
+    if (!cache->prefetch) {
+        ZF_LOGE("Failed to allocate memory");
+        return -1;
+    }
+
+    for (unsigned int index = 0; index < PCI_CFG_CACHE_DWORDS; index++) {
+        if (PCI_CFG_CACHEABLE_HEADER & (1ULL << index)) {
+            pci_cfg_cache_add(pcidev, index);
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t pci_cfg_cached_read(pcidev_t *pcidev, unsigned int offset,
+                                    size_t size)
+{
+    pci_cfg_cache_t *cache = &pcidev->cfg_cache;
+    unsigned int index = offset >> 2;
+    unsigned int shift = (offset & 3) * 8;
+
+    if (offset + size > PCI_CFG_CACHE_SIZE || (offset & 3) + size > 4 ||
+        !(__atomic_load_n(&cache->cacheable, __ATOMIC_RELAXED) & (1ULL << index))) {
+        return pci_cfg_read(pcidev, offset, size);
+    }
+
+    uint64_t entry = __atomic_load_n(&cache->entry[index], __ATOMIC_ACQUIRE);
+    uint32_t value = entry;
+
+    if (!(entry & PCI_CFG_ENTRY_VALID)) {
+        if (pci_cfg_fetch(pcidev, index, &value)) {
+            return 0;
+        }
+        pci_cfg_cache_fill(pcidev, index, entry, value);
+    }
+
+    value >>= shift;
+    if (size < 4) {
+        value &= (1U << (size * 8)) - 1;
+    }
+
+    return value;
+}
+
+static void pci_cfg_cached_write(pcidev_t *pcidev, unsigned int offset,
+                                 size_t size, uint32_t value)
+{
+    pci_cfg_write(pcidev, offset, size, value);
+
+    /* after the write has completed, so that reads issued before it do not
+     * fill the cache with the old value
+     */
+    for (unsigned int index = offset >> 2;
+         index < PCI_CFG_CACHE_DWORDS && index <= (offset + size - 1) >> 2;
+         index++) {
+        pci_cfg_cache_invalidate(pcidev, index);
+    }
+}
+
 static uint8_t pci_cfg_read8(void *cookie, vmm_pci_address_t addr,
                              unsigned int offset)
 {
@@ -116,38 +328,38 @@ static uint8_t pci_cfg_read8(void *cookie, vmm_pci_address_t addr,
         /* Map device interrupt to INTx pin */
         return pci_map_irq(cookie) + 1;
     default:
-        return pci_cfg_read(cookie, offset, 1);
+        return pci_cfg_cached_read(cookie, offset, 1);
     }
 }
 
 static uint16_t pci_cfg_read16(void *cookie, vmm_pci_address_t addr,
                                unsigned int offset)
 {
-    return pci_cfg_read(cookie, offset, 2);
+    return pci_cfg_cached_read(cookie, offset, 2);
 }
 
 static uint32_t pci_cfg_read32(void *cookie, vmm_pci_address_t addr,
                                   unsigned int offset)
 {
-    return pci_cfg_read(cookie, offset, 4);
+    return pci_cfg_cached_read(cookie, offset, 4);
 }
 
 static void pci_cfg_write8(void *cookie, vmm_pci_address_t addr,
                            unsigned int offset, uint8_t val)
 {
-    pci_cfg_write(cookie, offset, 1, val);
+    pci_cfg_cached_write(cookie, offset, 1, val);
 }
 
 static void pci_cfg_write16(void *cookie, vmm_pci_address_t addr,
                             unsigned int offset, uint16_t val)
 {
-    pci_cfg_write(cookie, offset, 2, val);
+    pci_cfg_cached_write(cookie, offset, 2, val);
 }
 
 static void pci_cfg_write32(void *cookie, vmm_pci_address_t addr,
                             unsigned int offset, uint32_t val)
 {
-    pci_cfg_write(cookie, offset, 4, val);
+    pci_cfg_cached_write(cookie, offset, 4, val);
 }
 
 static int pcidev_register(vmm_pci_space_t *pci, io_proxy_t *io_proxy,
@@ -197,6 +409,9 @@ static int pcidev_register(vmm_pci_space_t *pci, io_proxy_t *io_proxy,
 
     pci_devs[pci_dev_count++] = pcidev;
 
+    /* uncached config space accesses still work without the prefetch */
+    pci_cfg_cache_init(pcidev);
+
     return 0;
 }
 
@@ -299,25 +514,96 @@ static int handle_control(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
     return RPCMSG_RC_HANDLED;
 }
 
-static rpc_callback_fn_t rpc_callbacks[] = {
-    handle_mmio,
-    handle_msi,
-    handle_pci,
-    handle_emudev,
-    handle_control,
-    NULL,
-};
+/* RPC dispatch
+ *
+ * Messages are dispatched by their opcode through rpc_handlers[], and
+ * QEMU_OP_SET_IRQ further by the interrupt number through rpc_irq_map[],
+ * which holds the index + 1 of the handler in rpc_irq_handlers[] of each
+ * interrupt registered with rpc_register_irqs(). Interrupts not in the map
+ * go to the QEMU_OP_SET_IRQ handler.
+ */
+#define RPC_IRQ_MAP_SIZE        1024
+#define RPC_IRQ_HANDLERS_MAX    8
+
+static rpc_callback_fn_t rpc_handlers[RPC_NUM_OPS];
+static rpc_callback_fn_t rpc_irq_handlers[RPC_IRQ_HANDLERS_MAX];
+static uint8_t rpc_irq_map[RPC_IRQ_MAP_SIZE];
 
-static int rpc_process(rpcmsg_t *msg, void *cookie)
+/* Handle messages of opcode @op with @handler. Registering the same handler
+ * again is a no-op.
+ */
+int rpc_register(unsigned int op, rpc_callback_fn_t handler)
 {
-    io_proxy_t *io_proxy = cookie;
+    if (op >= ARRAY_SIZE(rpc_handlers) || !handler) {
+        ZF_LOGE("Invalid RPC handler for message %u", op);
+        return -1;
+    }
 
-    unsigned int op = QEMU_OP(msg->mr0);
+    if (rpc_handlers[op] && rpc_handlers[op] != handler) {
+        ZF_LOGE("RPC message %u has a handler already", op);
+        return -1;
+    }
 
+    rpc_handlers[op] = handler;
+
+    return 0;
+}
+
+/* Handle QEMU_OP_SET_IRQ of interrupts @irq_base to @irq_base + @num_irq - 1
+ * with @handler
+ */
+int rpc_register_irqs(uint32_t irq_base, uint32_t num_irq,
+                      rpc_callback_fn_t handler)
+{
+    unsigned int i;
+
+    if (!handler || irq_base >= RPC_IRQ_MAP_SIZE ||
+        num_irq > RPC_IRQ_MAP_SIZE - irq_base) {
+        ZF_LOGE("Invalid RPC handler for interrupts %u-%u", irq_base,
+                irq_base + num_irq - 1);
+        return -1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(rpc_irq_handlers); i++) {
+        if (!rpc_irq_handlers[i] || rpc_irq_handlers[i] == handler) {
+            break;
+        }
+    }
+
+    if (i == ARRAY_SIZE(rpc_irq_handlers)) {
+        ZF_LOGE("Too many RPC interrupt handlers");
+        return -1;
+    }
+
+    for (uint32_t irq = irq_base; irq < irq_base + num_irq; irq++) {
+        if (rpc_irq_map[irq] && rpc_irq_map[irq] != i + 1) {
+            ZF_LOGE("Interrupt %u has a handler already", irq);
+            return -1;
+        }
+    }
+
+    rpc_irq_handlers[i] = handler;
+    memset(&rpc_irq_map[irq_base], i + 1, num_irq);
+
+    return 0;
+}
+
+static int rpc_dispatch(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
+{
+    rpc_callback_fn_t handler = NULL;
     int rc = RPCMSG_RC_NONE;
-    for (rpc_callback_fn_t *cb = rpc_callbacks;
-         rc == RPCMSG_RC_NONE && *cb; cb++) {
-        rc = (*cb)(io_proxy, op, msg);
+
+    if (op < ARRAY_SIZE(rpc_handlers)) {
+        handler = rpc_handlers[op];
+        if (op == QEMU_OP_SET_IRQ && msg->mr1 < RPC_IRQ_MAP_SIZE &&
+            rpc_irq_map[msg->mr1]) {
+            handler = rpc_irq_handlers[rpc_irq_map[msg->mr1] - 1];
+        }
+        io_proxy->rpc_hits[op]++;
+    }
+
+    if (handler) {
+        rc = handler(io_proxy, op, msg);
     }
 
     if (rc == RPCMSG_RC_ERROR) {
@@ -331,30 +617,189 @@ static int rpc_process(rpcmsg_t *msg, void *cookie)
     return 0;
 }
 
-int rpc_run(io_proxy_t *io_proxy)
+void rpc_dispatch_report(io_proxy_t *io_proxy)
+{
+    for (unsigned int op = 0; op < ARRAY_SIZE(io_proxy->rpc_hits); op++) {
+        if (io_proxy->rpc_hits[op]) {
+            ZF_LOGI("rpc op %u: %llu messages", op,
+                    (unsigned long long) io_proxy->rpc_hits[op]);
+        }
+    }
+}
+
+static int rpc_handlers_init(void)
+{
+    int err = 0;
+
+    err |= rpc_register(QEMU_OP_MMIO, handle_mmio);
+    err |= rpc_register(QEMU_OP_START_VM, handle_control);
+    err |= rpc_register(QEMU_OP_REGISTER_PCI_DEV, handle_pci);
+    err |= rpc_register(QEMU_OP_MMIO_REGION_CONFIG, handle_emudev);
+    err |= rpc_register(QEMU_OP_KICK_CONFIG, handle_emudev);
+    /* emulated devices get the interrupts nobody else has registered */
+    err |= rpc_register(QEMU_OP_SET_IRQ, handle_emudev);
+    err |= rpc_register_irqs(0, PCI_NUM_SLOTS, handle_pci);
+
+    return err ? -1 : 0;
+}
+
+/* Process QEMU_OP_SET_IRQ_BATCH as a sequence of QEMU_OP_SET_IRQ messages */
+static int rpc_process_irq_batch(io_proxy_t *io_proxy, rpcmsg_t *msg,
+                                 const void *payload, int len)
+{
+    const rpc_irq_update_t *updates = payload;
+    seL4_Word n = msg->mr1;
+
+    if (!payload || len < 0 || len % sizeof(*updates) ||
+        n != len / sizeof(*updates)) {
+        ZF_LOGE("Invalid IRQ batch: %lu updates, %d bytes", (unsigned long) n,
+                len);
+        return -1;
+    }
+
+    for (seL4_Word i = 0; i < n; i++) {
+        rpcmsg_t irq = {
+            .mr0 = BIT_FIELD_SET(0, RPC_MR0_OP, QEMU_OP_SET_IRQ),
+            .mr1 = updates[i].irq,
+            .mr2 = updates[i].op,
+        };
+
+        int err = rpc_dispatch(io_proxy, QEMU_OP_SET_IRQ, &irq);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* Interrupt lines taken from the iobuf, see rpc_take_irqs() */
+typedef struct rpc_irqs {
+    uint32_t pending[RPCMSG_IRQ_WORDS];
+    uint32_t level[RPCMSG_IRQ_WORDS];
+    uint32_t pulse[RPCMSG_IRQ_WORDS];
+} rpc_irqs_t;
+
+/* Take the interrupt lines the backend raised through the iobuf */
+static void rpc_take_irqs(io_proxy_t *io_proxy, rpc_irqs_t *irqs)
+{
+    for (unsigned int word = 0; word < RPCMSG_IRQ_WORDS; word++) {
+        irqs->pending[word] = vso_rpc_irqs_take(&io_proxy->rpc, word,
+                                                &irqs->level[word],
+                                                &irqs->pulse[word]);
+    }
+}
+
+/* Inject the interrupt lines taken with rpc_take_irqs() */
+static int rpc_process_irqs(io_proxy_t *io_proxy, rpc_irqs_t *irqs)
+{
+    for (unsigned int word = 0; word < RPCMSG_IRQ_WORDS; word++) {
+        uint32_t level = irqs->level[word];
+        uint32_t pulse = irqs->pulse[word];
+        uint32_t pending = irqs->pending[word];
+
+        while (pending) {
+            uint32_t bit = pending & -pending;
+            pending &= ~bit;
+
+            rpcmsg_t irq = {
+                .mr0 = BIT_FIELD_SET(0, RPC_MR0_OP, QEMU_OP_SET_IRQ),
+                .mr1 = word * 32 + __builtin_ctz(bit),
+                .mr2 = (pulse & bit) ? RPC_IRQ_PULSE :
+                       (level & bit) ? RPC_IRQ_SET : RPC_IRQ_CLR,
+            };
+
+            int err = rpc_dispatch(io_proxy, QEMU_OP_SET_IRQ, &irq);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int rpc_process(rpcmsg_t *msg, const void *payload, int len,
+                       void *cookie)
+{
+    io_proxy_t *io_proxy = cookie;
+
+    unsigned int op = QEMU_OP(msg->mr0);
+
+    if (op == QEMU_OP_SET_IRQ_BATCH) {
+        return rpc_process_irq_batch(io_proxy, msg, payload, len);
+    }
+
+    return rpc_dispatch(io_proxy, op, msg);
+}
+
+__thread unsigned int rpc_run_depth;
+
+static int rpc_drain(io_proxy_t *io_proxy)
 {
     rpcmsg_t *resp;
-    rpcmsg_t event;
+    rpcmsg_t *event;
     uint16_t id;
+    int len;
     int rc = 0;
 
-    /* process ioreqs first */
-    for_each_driver_rpc_resp(resp, id, &io_proxy->rpc) {
-        rc = rpc_process(resp, io_proxy);
-        if (rc) {
-            fprintf(stderr, "processing rpc failed (%d)\n", rc);
-            break;
+    /* no doorbells needed while we are polling */
+    vso_rpc_disarm(&io_proxy->rpc);
+
+    do {
+        /* Interrupts are taken first but injected after the events. The
+         * device raises a line after sending the events it depends on, e.g.
+         * the registration of the PCI device, so those are queued by now.
+         */
+        rpc_irqs_t irqs;
+        rpc_take_irqs(io_proxy, &irqs);
+
+        /* ioreqs */
+        for_each_driver_rpc_resp(resp, id, &io_proxy->rpc) {
+            /* reply payloads are read in place */
+            rpcmsg_buffer_t *b = io_proxy->rpc.driver_rpc.response.buffer;
+            len = min(vso_payload_len(resp), b->payload_size);
+            rc = rpc_process(resp, rpcmsg_payload(b, id), len, io_proxy);
+            if (rc) {
+                fprintf(stderr, "processing rpc failed (%d)\n", rc);
+                return rc;
+            }
+            vso_trace_complete(&io_proxy->rpc, io_proxy->trace, resp);
         }
-    }
 
-    /* process events */
-    for_each_device_event(event, &io_proxy->rpc) {
-        rc = rpc_process(&event, io_proxy);
+        /* process events in place, the high priority lane first */
+        while ((event = device_event_peek(&io_proxy->rpc))) {
+            len = min(vso_payload_len(event), io_proxy->iobuf_payload_size);
+            rc = rpc_process(event, device_event_payload(&io_proxy->rpc, event),
+                             len, io_proxy);
+            device_event_release(&io_proxy->rpc, event);
+            if (rc) {
+                fprintf(stderr, "processing rpc failed (%d)\n", rc);
+                return rc;
+            }
+        }
+
+        rc = rpc_process_irqs(io_proxy, &irqs);
         if (rc) {
-            fprintf(stderr, "processing rpc failed (%d)\n", rc);
-            break;
+            fprintf(stderr, "processing interrupts failed (%d)\n", rc);
+            return rc;
         }
-    }
+    } while (vso_rpc_arm(&io_proxy->rpc));
+
+    /* wake up device producers stalled on the event queue */
+    vso_rpc_space_notify(&io_proxy->rpc);
+
+    /* and our own stalled on the request queues or the message pool */
+    io_proxy_space_wake(io_proxy);
+
+    return rc;
+}
+
+int rpc_run(io_proxy_t *io_proxy)
+{
+    rpc_run_depth++;
+    int rc = rpc_drain(io_proxy);
+    rpc_run_depth--;
 
     return rc;
 }
@@ -395,6 +840,53 @@ static memory_fault_result_t mmio_fault_handler(vm_t *vm, vm_vcpu_t *vcpu,
         dir = SEL4_IO_DIR_WRITE;
     }
 
+    if (dir == SEL4_IO_DIR_WRITE) {
+        /* no request at all, the backend only learns about the kick */
+        int kick = io_proxy_kick_find(io_proxy, paddr, value);
+        if (kick >= 0 && !vso_rpc_kick(&io_proxy->rpc, kick)) {
+            advance_vcpu_fault(vcpu);
+            return FAULT_HANDLED;
+        }
+    }
+
+    /* a copy, the backend may reconfigure the region meanwhile */
+    io_proxy_region_t region;
+    unsigned int flags = 0;
+
+    if (!io_proxy_region_find(io_proxy, paddr, len, &region)) {
+        flags = region.flags;
+    }
+
+    if (dir == SEL4_IO_DIR_READ) {
+        if (flags & SEL4_MMIO_REGION_SHADOW) {
+            uint32_t offset = region.shadow + (paddr - region.addr);
+            bool clear = flags & SEL4_MMIO_REGION_READ_CLEAR;
+
+            if (!vso_rpc_shadow_read(&io_proxy->rpc, offset, len, clear,
+                                     &value)) {
+                ioack_vcpu_read(value, vcpu);
+                return FAULT_HANDLED;
+            }
+        }
+    } else {
+        /* a full ring falls back to a posted write, which the backend
+         * handles after draining the ring
+         */
+        if ((flags & SEL4_MMIO_REGION_COALESCED) &&
+            !vso_rpc_coalesce(&io_proxy->rpc, paddr, len, value)) {
+            advance_vcpu_fault(vcpu);
+            return FAULT_HANDLED;
+        }
+
+        if (flags & (SEL4_MMIO_REGION_POSTED | SEL4_MMIO_REGION_COALESCED)) {
+            if (!ioreq_post(io_proxy, AS_GLOBAL, paddr, len, value)) {
+                advance_vcpu_fault(vcpu);
+                return FAULT_HANDLED;
+            }
+            /* no free ioreq slot, wait for the reply instead */
+        }
+    }
+
     int err = ioreq_start(io_proxy, vcpu->vcpu_id, ioack_vcpu_read,
                           ioack_vcpu_write, vcpu, AS_GLOBAL, dir, paddr, len,
                           value);
@@ -447,7 +939,13 @@ int libsel4vm_io_proxy_init(vm_t *vm, io_proxy_t *io_proxy)
                                        io_proxy);
     ZF_LOGF_IF(!reservation, "Cannot reserve vspace for virtio control plane");
 
-    int err = irq_init(vm);
+    int err = rpc_handlers_init();
+    if (err) {
+        ZF_LOGE("rpc_handlers_init() failed");
+        return -1;
+    }
+
+    err = irq_init(vm);
     if (err) {
         ZF_LOGE("irq_init() failed");
         return -1;
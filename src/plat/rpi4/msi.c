@@ -57,5 +57,10 @@ int handle_msi(io_proxy_t *io_proxy, unsigned int op, rpcmsg_t *msg)
 
 int msi_init(vm_t *vm)
 {
+    int err = rpc_register_irqs(v2m.irq_base, v2m.num_irq, handle_msi);
+    if (err) {
+        return err;
+    }
+
     return v2m_init(&v2m, vm);
 }
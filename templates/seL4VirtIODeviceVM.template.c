@@ -66,7 +66,7 @@ DEFINE_MODULE_DEP(vpci_register_devices, cross_vm_connections)
 const char *append_vm_virtio_device_cmdline(char *buffer)
 {
 /*- if vm_virtio_drivers|length > 0 -*/
-    unsigned int id;
+    unsigned int id, ring_size, pool_size, payload_size;
     uintptr_t data_base, ctrl_base;
     size_t data_size, ctrl_size;
     char *p = buffer;
@@ -78,10 +78,17 @@ const char *append_vm_virtio_device_cmdline(char *buffer)
     data_size = /*? drv.data_size ?*/;
     ctrl_base = /*? drv.ctrl_base ?*/;
     ctrl_size = /*? drv.ctrl_size ?*/;
+    ring_size = /*? drv.ring_size ?*/;
+    pool_size = /*? drv.pool_size ?*/;
+    payload_size = /*? drv.payload_size ?*/;
     /* TODO: safety checks */
     p += strlen(p);
-    sprintf(p, " uservm=%u,0x%"PRIxPTR",0x%zx,0x%"PRIxPTR",0x%zx", id,
-            data_base, data_size, ctrl_base, ctrl_size);
+    /* ring, pool and payload sizes let the device side verify the iobuf
+     * layout
+     */
+    sprintf(p, " uservm=%u,0x%"PRIxPTR",0x%zx,0x%"PRIxPTR",0x%zx,%u,%u,%u", id,
+            data_base, data_size, ctrl_base, ctrl_size, ring_size, pool_size,
+            payload_size);
 /*- endfor -*/
 
     return buffer;
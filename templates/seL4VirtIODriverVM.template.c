@@ -17,6 +17,7 @@
 
 /*- for dev in vm_virtio_devices -*/
 extern void *vm/*? dev.id ?*/_iobuf;
+extern dataport_caps_handle_t vm/*? dev.id ?*/_iobuf_handle;
 
 ram_dataport_t __attribute__((section("_ram_dataport_definition"))) vm/*? dev.id ?*/_ram_dataport;
 
@@ -25,6 +26,23 @@ static uintptr_t vm/*? dev.id ?*/_iobuf_get(io_proxy_t *io_proxy)
     return (uintptr_t)vm/*? dev.id ?*/_iobuf;
 }
 
+static size_t vm/*? dev.id ?*/_iobuf_size_get(io_proxy_t *io_proxy)
+{
+    dataport_caps_handle_t *dp = &vm/*? dev.id ?*/_iobuf_handle;
+
+    return dp->get_num_frame_caps() * BIT(dp->get_frame_size_bits());
+}
+
+/* the iobuf dataport must hold the configured rings, pool and payloads */
+static_assert(RPCMSG_SIZE_VALID(/*? dev.ring_size ?*/) &&
+              /*? dev.pool_size ?*/ > 0 &&
+              /*? dev.pool_size ?*/ <= /*? dev.ring_size ?*/ &&
+              RPCMSG_PAYLOAD_SIZE_VALID(/*? dev.payload_size ?*/),
+              "vm/*? dev.id ?*/ iobuf ring, pool or payload size invalid");
+static_assert(rpcmsg_iobuf_bytes(/*? dev.ring_size ?*/, /*? dev.pool_size ?*/,
+                                 /*? dev.payload_size ?*/) <= /*? dev.data_size ?*/,
+              "vm/*? dev.id ?*/ iobuf too small for its ring, pool and payload sizes");
+
 static void vm/*? dev.id ?*/_notify(void *cookie)
 {
     vm/*? dev.id ?*/_ntfn_send_emit();
@@ -69,6 +87,11 @@ io_proxy_t vm/*? dev.id ?*/_io_proxy = {
     .ctrl_size = /*? dev.ctrl_size ?*/,
     .run = vm/*? dev.id ?*/_io_proxy_run,
     .iobuf_get = vm/*? dev.id ?*/_iobuf_get,
+    .iobuf_size_get = vm/*? dev.id ?*/_iobuf_size_get,
+    .iobuf_ring_size = /*? dev.ring_size ?*/,
+    .iobuf_pool_size = /*? dev.pool_size ?*/,
+    .iobuf_payload_size = /*? dev.payload_size ?*/,
+    .ioreq_slots = /*? dev.ioreq_slots ?*/,
     .rpc = {
         /* queue addresses need to be filled in run time */
         .doorbell = vm/*? dev.id ?*/_notify,